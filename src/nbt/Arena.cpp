@@ -0,0 +1,71 @@
+/* Arena.cpp
+ *
+ * A bump allocator owning all nodes of a loaded tag tree
+ *
+ * by Gjum <gjum42@gmail.com>
+ */
+
+#include "Arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+//#define DEBUG if (1)
+#ifndef DEBUG
+#define DEBUG if (0)
+#endif
+
+namespace NBT {
+
+    // blocks are at least blockSize bytes large
+    Arena::Arena(size_t blockSize_) {
+        blocks = NULL;
+        cursor = NULL;
+        end = NULL;
+        blockSize = blockSize_ > 256 ? blockSize_ : 256;
+    }
+
+    Arena::~Arena() {
+        while (blocks != NULL) {
+            Block * next = blocks->next;
+            free(blocks);
+            blocks = next;
+        }
+    }
+
+    // frees all allocations at once, keeps the largest block for reuse
+    void Arena::reset() {
+        if (blocks == NULL) return;
+        Block * largest = blocks;
+        for (Block * block = blocks->next; block != NULL; block = block->next)
+            if (block->size > largest->size) largest = block;
+        while (blocks != NULL) {
+            Block * next = blocks->next;
+            if (blocks != largest) free(blocks);
+            blocks = next;
+        }
+        largest->next = NULL;
+        blocks = largest;
+        cursor = (char *) (blocks + 1);
+        end = cursor + blocks->size;
+    }
+
+    void * Arena::allocateInNewBlock(size_t size, size_t align) {
+        size_t usable = size + align > blockSize ? size + align : blockSize;
+        Block * block = (Block *) malloc(sizeof(Block) + usable);
+        if (block == NULL) throw std::bad_alloc();
+        DEBUG printf("Arena: new block of %lu bytes\n", (unsigned long int) usable);
+        block->next = blocks;
+        block->size = usable;
+        blocks = block;
+        // later blocks grow, so large trees need few of them
+        if (blockSize < (1 << 24)) blockSize *= 2;
+        cursor = (char *) (block + 1);
+        end = cursor + usable;
+        size_t padding = (align - (size_t) cursor % align) % align;
+        char * result = cursor + padding;
+        cursor = result + size;
+        return result;
+    }
+
+}
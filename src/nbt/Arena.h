@@ -0,0 +1,91 @@
+/* Arena.h
+ *
+ * A bump allocator owning all nodes of a loaded tag tree
+ *
+ * Allocating is moving a pointer inside the current block, nothing is
+ * freed on its own. The whole tree is freed at once with the arena,
+ * see loadArena in Tag.h.
+ *
+ * by Gjum <gjum42@gmail.com>
+ */
+#ifndef NBT_ARENA_H
+#define NBT_ARENA_H
+
+#include <stddef.h>
+#include <new>
+
+namespace NBT {
+
+    class Arena {
+        public:
+            // blocks are at least blockSize bytes large
+            Arena(size_t blockSize = 65536);
+            ~Arena();
+
+            // returns size bytes aligned to align, valid until reset() or destruction
+            void * allocate(size_t size, size_t align) {
+                size_t padding = (align - (size_t) cursor % align) % align;
+                if (cursor == NULL || padding + size > (size_t) (end - cursor))
+                    return allocateInNewBlock(size, align);
+                char * result = cursor + padding;
+                cursor = result + size;
+                return result;
+            }
+
+            // constructs a T inside the arena, its destructor is never called
+            template <typename T, typename... Args> T * create(Args... args) {
+                return new (allocate(sizeof(T), alignof(T))) T(args...);
+            }
+
+            // frees all allocations at once, keeps the largest block for reuse
+            void reset();
+
+        private:
+            struct Block {
+                Block * next;
+                size_t size; // usable bytes behind the header
+            };
+
+            Block * blocks; // most recent first
+            char * cursor;
+            char * end;
+            size_t blockSize;
+
+            void * allocateInNewBlock(size_t size, size_t align);
+
+            Arena(const Arena &);             // not copyable
+            Arena & operator=(const Arena &); // the blocks are owned
+    };
+
+    // lets containers allocate from an arena, or from the heap if it is NULL
+    // memory given back to an arena is only freed with the arena
+    template <typename T> class ArenaAllocator {
+        public:
+            typedef T value_type;
+
+            ArenaAllocator(Arena * arena_ = NULL) : arena(arena_) {}
+            template <typename U> ArenaAllocator(const ArenaAllocator<U> & other) : arena(other.arena) {}
+
+            T * allocate(size_t n) {
+                if (arena == NULL) return static_cast<T *>(::operator new(n * sizeof(T)));
+                return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+            }
+            void deallocate(T * p, size_t) {
+                if (arena == NULL) ::operator delete(p);
+            }
+
+            Arena * arena;
+    };
+
+    template <typename T, typename U>
+    bool operator==(const ArenaAllocator<T> & a, const ArenaAllocator<U> & b) {
+        return a.arena == b.arena;
+    }
+    template <typename T, typename U>
+    bool operator!=(const ArenaAllocator<T> & a, const ArenaAllocator<U> & b) {
+        return a.arena != b.arena;
+    }
+
+}
+
+#endif
@@ -0,0 +1,135 @@
+/* BitArray.cpp
+ *
+ * Unpacking of values packed into long arrays
+ *
+ * by Gjum <gjum42@gmail.com>
+ */
+
+#include "BitArray.h"
+#include "Endian.h"
+
+#include <stdio.h>
+
+//#define DEBUG if (1)
+#ifndef DEBUG
+#define DEBUG if (0)
+#endif
+
+namespace NBT {
+
+    // longs in native byte order
+    struct NativeLongs {
+        const int64_t * data;
+        uint64_t operator[](size_t i) const { return data[i]; }
+    };
+
+    // longs in big-endian byte order, swapped when read
+    struct BigEndianLongs {
+        const char * data;
+        uint64_t operator[](size_t i) const { return loadBigEndian64(data + 8*i); }
+    };
+
+    // each long holds 64/bits values, the high bits are unused
+    template <unsigned int bits, typename Longs>
+    static void unpackPadded(Longs packed, uint16_t * out, size_t count) {
+        const unsigned int perLong = 64 / bits;
+        const uint64_t mask = (1ULL << bits) - 1;
+        size_t full = count / perLong;
+        for (size_t k = 0; k < full; k++) {
+            uint64_t value = packed[k];
+            for (unsigned int j = 0; j < perLong; j++)
+                out[k*perLong + j] = (value >> (j*bits)) & mask;
+        }
+        uint64_t value = full*perLong < count ? packed[full] : 0;
+        for (size_t i = full*perLong; i < count; i++, value >>= bits)
+            out[i] = value & mask;
+    }
+
+    // values follow each other without gaps, some span two longs
+    template <unsigned int bits, typename Longs>
+    static void unpackSpanning(Longs packed, uint16_t * out, size_t count) {
+        const uint64_t mask = (1ULL << bits) - 1;
+        // every 64 values fill exactly bits longs, so all shifts are constant
+        size_t groups = count / 64;
+        for (size_t g = 0; g < groups; g++) {
+            uint64_t longs[bits];
+            for (unsigned int k = 0; k < bits; k++)
+                longs[k] = packed[g*bits + k];
+            for (unsigned int j = 0; j < 64; j++) {
+                unsigned int k = j*bits / 64;
+                unsigned int offset = j*bits % 64;
+                uint64_t value = longs[k] >> offset;
+                if (offset + bits > 64) value |= longs[k+1] << (64 - offset);
+                out[g*64 + j] = value & mask;
+            }
+        }
+        for (size_t i = groups*64; i < count; i++) {
+            size_t k = i*bits / 64;
+            unsigned int offset = i*bits % 64;
+            uint64_t value = packed[k] >> offset;
+            if (offset + bits > 64) value |= packed[k+1] << (64 - offset);
+            out[i] = value & mask;
+        }
+    }
+
+    template <unsigned int bits, typename Longs>
+    static void unpackWidth(Longs packed, BitLayout layout, uint16_t * out, size_t count) {
+        if (layout == bitsSpanning) unpackSpanning<bits>(packed, out, count);
+        else unpackPadded<bits>(packed, out, count);
+    }
+
+    template <typename Longs>
+    static bool unpack(Longs packed, size_t length, unsigned int bits, BitLayout layout, uint16_t * out, size_t count) {
+        if (bits < 1 || bits > maxPackedBits) {
+            printf("ERROR: cannot unpack values of %u bits\n", bits);
+            return false;
+        }
+        if (length < packedLength(count, bits, layout)) {
+            printf("ERROR: %lu longs are too few for %lu values of %u bits\n",
+                    (unsigned long int) length, (unsigned long int) count, bits);
+            return false;
+        }
+        DEBUG printf("Unpacking %lu values of %u bits\n", (unsigned long int) count, bits);
+        switch (bits) {
+            case  1: unpackWidth< 1>(packed, layout, out, count); break;
+            case  2: unpackWidth< 2>(packed, layout, out, count); break;
+            case  3: unpackWidth< 3>(packed, layout, out, count); break;
+            case  4: unpackWidth< 4>(packed, layout, out, count); break;
+            case  5: unpackWidth< 5>(packed, layout, out, count); break;
+            case  6: unpackWidth< 6>(packed, layout, out, count); break;
+            case  7: unpackWidth< 7>(packed, layout, out, count); break;
+            case  8: unpackWidth< 8>(packed, layout, out, count); break;
+            case  9: unpackWidth< 9>(packed, layout, out, count); break;
+            case 10: unpackWidth<10>(packed, layout, out, count); break;
+            case 11: unpackWidth<11>(packed, layout, out, count); break;
+            case 12: unpackWidth<12>(packed, layout, out, count); break;
+            case 13: unpackWidth<13>(packed, layout, out, count); break;
+            case 14: unpackWidth<14>(packed, layout, out, count); break;
+            case 15: unpackWidth<15>(packed, layout, out, count); break;
+            case 16: unpackWidth<16>(packed, layout, out, count); break;
+        }
+        return true;
+    }
+
+    // returns the number of longs holding count values of bits bits
+    size_t packedLength(size_t count, unsigned int bits, BitLayout layout) {
+        if (bits < 1 || bits > 64) return 0;
+        if (layout == bitsSpanning) return (count*bits + 63) / 64;
+        size_t perLong = 64 / bits;
+        return (count + perLong-1) / perLong;
+    }
+
+    // expands count values of bits bits from the length longs at packed into out
+    // false if bits is not in 1..maxPackedBits or packed is too short
+    bool unpackBits(const int64_t * packed, size_t length, unsigned int bits, BitLayout layout, uint16_t * out, size_t count) {
+        NativeLongs longs = { packed };
+        return unpack(longs, length, bits, layout, out, count);
+    }
+
+    // same as above, but the longs are still big-endian, like arrays loaded with loadView
+    bool unpackBitsBigEndian(const char * packed, size_t length, unsigned int bits, BitLayout layout, uint16_t * out, size_t count) {
+        BigEndianLongs longs = { packed };
+        return unpack(longs, length, bits, layout, out, count);
+    }
+
+}
@@ -0,0 +1,42 @@
+/* BitArray.h
+ *
+ * Unpacking of values packed into long arrays, like the BlockStates
+ * palette indices and the Heightmaps of modern chunks
+ *
+ * Each bit width has its own unrolled loop with constant shifts and masks,
+ * which the compiler vectorizes.
+ *
+ * by Gjum <gjum42@gmail.com>
+ */
+#ifndef NBT_BITARRAY_H
+#define NBT_BITARRAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace NBT {
+
+    // how values are packed into the longs, the lowest bits come first
+    enum BitLayout {
+        // values may span two longs, up to Minecraft 1.15
+        bitsSpanning,
+        // each long holds 64/bits values and unused high bits, since 1.16
+        bitsPadded
+    };
+
+    // the largest supported bit width
+    const unsigned int maxPackedBits = 16;
+
+    // returns the number of longs holding count values of bits bits
+    size_t packedLength(size_t count, unsigned int bits, BitLayout layout);
+
+    // expands count values of bits bits from the length longs at packed into out
+    // false if bits is not in 1..maxPackedBits or packed is too short
+    bool unpackBits(const int64_t * packed, size_t length, unsigned int bits, BitLayout layout, uint16_t * out, size_t count);
+
+    // same as above, but the longs are still big-endian, like arrays loaded with loadView
+    bool unpackBitsBigEndian(const char * packed, size_t length, unsigned int bits, BitLayout layout, uint16_t * out, size_t count);
+
+}
+
+#endif
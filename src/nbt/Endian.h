@@ -0,0 +1,114 @@
+/* Endian.h
+ *
+ * Decoding of big-endian NBT values on little-endian machines
+ *
+ * The array functions convert whole TAG_Int_Array and TAG_Long_Array
+ * payloads at once, in both directions: with SSSE3 or AVX2 shuffles if
+ * the compiler targets them (-mssse3, -mavx2, or -march=native),
+ * else with bswap loops.
+ *
+ * by Gjum <gjum42@gmail.com>
+ */
+#ifndef NBT_ENDIAN_H
+#define NBT_ENDIAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+namespace NBT {
+
+    inline uint32_t swap32(uint32_t value) {
+#if defined(__GNUC__)
+        return __builtin_bswap32(value);
+#else
+        return (value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000) | (value << 24);
+#endif
+    }
+
+    inline uint64_t swap64(uint64_t value) {
+#if defined(__GNUC__)
+        return __builtin_bswap64(value);
+#else
+        return ((uint64_t) swap32(value) << 32) | swap32(value >> 32);
+#endif
+    }
+
+    // reads one big-endian value from in, which needs no alignment
+    inline int32_t loadBigEndian32(const char * in) {
+        uint32_t value;
+        memcpy(&value, in, 4);
+        return swap32(value);
+    }
+
+    inline int64_t loadBigEndian64(const char * in) {
+        uint64_t value;
+        memcpy(&value, in, 8);
+        return swap64(value);
+    }
+
+    // copies count 32 bit values from in to out, reversing the bytes of each
+    // decodes big-endian arrays and encodes them again
+    // in and out need no alignment and may be the same
+    inline void swapArray32(void * out, const void * in, size_t count) {
+        const char * src = (const char *) in;
+        char * dst = (char *) out;
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i mask = _mm256_setr_epi8(
+                3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        for (; i + 8 <= count; i += 8) {
+            __m256i values = _mm256_loadu_si256((const __m256i *) (src + 4*i));
+            _mm256_storeu_si256((__m256i *) (dst + 4*i), _mm256_shuffle_epi8(values, mask));
+        }
+#elif defined(__SSSE3__)
+        const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        for (; i + 4 <= count; i += 4) {
+            __m128i values = _mm_loadu_si128((const __m128i *) (src + 4*i));
+            _mm_storeu_si128((__m128i *) (dst + 4*i), _mm_shuffle_epi8(values, mask));
+        }
+#endif
+        for (; i < count; i++) {
+            uint32_t value;
+            memcpy(&value, src + 4*i, 4);
+            value = swap32(value);
+            memcpy(dst + 4*i, &value, 4);
+        }
+    }
+
+    // copies count 64 bit values from in to out, reversing the bytes of each
+    // in and out need no alignment and may be the same
+    inline void swapArray64(void * out, const void * in, size_t count) {
+        const char * src = (const char *) in;
+        char * dst = (char *) out;
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i mask = _mm256_setr_epi8(
+                7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        for (; i + 4 <= count; i += 4) {
+            __m256i values = _mm256_loadu_si256((const __m256i *) (src + 8*i));
+            _mm256_storeu_si256((__m256i *) (dst + 8*i), _mm256_shuffle_epi8(values, mask));
+        }
+#elif defined(__SSSE3__)
+        const __m128i mask = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        for (; i + 2 <= count; i += 2) {
+            __m128i values = _mm_loadu_si128((const __m128i *) (src + 8*i));
+            _mm_storeu_si128((__m128i *) (dst + 8*i), _mm_shuffle_epi8(values, mask));
+        }
+#endif
+        for (; i < count; i++) {
+            uint64_t value;
+            memcpy(&value, src + 8*i, 8);
+            value = swap64(value);
+            memcpy(dst + 8*i, &value, 8);
+        }
+    }
+
+}
+
+#endif
@@ -0,0 +1,279 @@
+/* Inflater.cpp
+ *
+ * A reusable decompressor for zlib and gzip data
+ *
+ * by Gjum <gjum42@gmail.com>
+ */
+
+#include "Inflater.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//#define DEBUG if (1)
+#ifndef DEBUG
+#define DEBUG if (0)
+#endif
+
+namespace NBT {
+
+    // the fastest compiled in backend, or the one from NBT_INFLATE
+    static InflateBackend initialDefaultBackend() {
+        const char * selected = getenv("NBT_INFLATE");
+        if (selected != NULL) {
+            InflateBackend backends[] = { inflateZlib, inflateZlibNg, inflateLibdeflate };
+            for (int i = 0; i < 3; i++) {
+                if (strcmp(selected, Inflater::backendToString(backends[i])) != 0) continue;
+                if (Inflater::isAvailable(backends[i])) return backends[i];
+                printf("ERROR: inflate backend '%s' is not compiled in\n", selected);
+            }
+        }
+#if defined(NBT_WITH_LIBDEFLATE)
+        return inflateLibdeflate;
+#elif defined(NBT_WITH_ZLIB_NG)
+        return inflateZlibNg;
+#else
+        return inflateZlib;
+#endif
+    }
+
+    static InflateBackend defaultBackend = initialDefaultBackend();
+
+    // the output buffer size to start with, enough for most chunks
+    static const unsigned long int initialCapacity = 65536;
+
+    Inflater::Inflater() {
+        backend = defaultBackend;
+        buffer = NULL;
+        capacity = initialCapacity;
+        input = NULL;
+        inputCapacity = 0;
+        memset(&stream, 0, sizeof(stream));
+        initialized = false;
+#ifdef NBT_WITH_ZLIB_NG
+        memset(&ngStream, 0, sizeof(ngStream));
+        ngInitialized = false;
+#endif
+#ifdef NBT_WITH_LIBDEFLATE
+        decompressor = NULL;
+#endif
+    }
+
+    Inflater::~Inflater() {
+        if (initialized) inflateEnd(&stream);
+#ifdef NBT_WITH_ZLIB_NG
+        if (ngInitialized) zng_inflateEnd(&ngStream);
+#endif
+#ifdef NBT_WITH_LIBDEFLATE
+        if (decompressor != NULL) libdeflate_free_decompressor(decompressor);
+#endif
+        if (buffer != NULL) delete[] buffer;
+        if (input != NULL) delete[] input;
+    }
+
+    // decompresses zlib or gzip data (detected from the header)
+    // the result stays in the output buffer until the next call
+    // sizeHint is the expected decompressed size if known, or 0
+    // NULL on error, outLength is set to the decompressed size
+    char * Inflater::inflate(const unsigned char * in, unsigned long int inLength, unsigned long int * outLength, unsigned long int sizeHint) {
+        *outLength = 0;
+        if (sizeHint == 0 && inLength >= 18 && in[0] == 0x1f && in[1] == 0x8b) {
+            // gzip stores the uncompressed size (mod 2^32) in its last 4 bytes, little-endian
+            const unsigned char * isize = in + inLength - 4;
+            sizeHint = (uint32_t(isize[3]) << 24) | (uint32_t(isize[2]) << 16) | (uint32_t(isize[1]) << 8) | isize[0];
+            // deflate compresses at most about 1:1032, ignore impossible sizes
+            if (sizeHint > inLength * 1032) sizeHint = 0;
+        }
+        if (sizeHint >= capacity) {
+            // one byte more, so a correct hint does not look like a full buffer
+            if (buffer != NULL) delete[] buffer;
+            buffer = NULL;
+            capacity = sizeHint + 1;
+        }
+        if (buffer == NULL) buffer = new char[capacity];
+        if (backend == inflateLibdeflate) return inflateWithLibdeflate(in, inLength, outLength, sizeHint);
+        if (backend == inflateZlibNg) return inflateWithZlibNg(in, inLength, outLength);
+        return inflateWithZlib(in, inLength, outLength);
+    }
+
+    // hands the output buffer to the caller, who has to delete[] it
+    // the next call allocates a new one of the initial capacity, not of the largest output so far
+    char * Inflater::releaseBuffer() {
+        char * released = buffer;
+        buffer = NULL;
+        capacity = initialCapacity;
+        return released;
+    }
+
+    // a buffer of at least length bytes for reading compressed data into,
+    // reused between calls like the output buffer
+    unsigned char * Inflater::getInputBuffer(unsigned long int length) {
+        if (length > inputCapacity) {
+            if (input != NULL) delete[] input;
+            inputCapacity = length > 2*inputCapacity ? length : 2*inputCapacity;
+            input = new unsigned char[inputCapacity];
+        }
+        return input;
+    }
+
+    InflateBackend Inflater::getBackend() const {
+        return backend;
+    }
+
+    // false if the backend is not compiled in
+    bool Inflater::setBackend(InflateBackend backend_) {
+        if (!isAvailable(backend_)) return false;
+        backend = backend_;
+        return true;
+    }
+
+    // the Inflater of the calling thread
+    Inflater & Inflater::forThread() {
+        static thread_local Inflater inflater;
+        return inflater;
+    }
+
+    // true if the backend is compiled in
+    bool Inflater::isAvailable(InflateBackend backend) {
+        if (backend == inflateZlib) return true;
+#ifdef NBT_WITH_ZLIB_NG
+        if (backend == inflateZlibNg) return true;
+#endif
+#ifdef NBT_WITH_LIBDEFLATE
+        if (backend == inflateLibdeflate) return true;
+#endif
+        return false;
+    }
+
+    // the backend of Inflaters created from now on
+    // false if the backend is not compiled in
+    bool Inflater::setDefaultBackend(InflateBackend backend) {
+        if (!isAvailable(backend)) return false;
+        defaultBackend = backend;
+        return true;
+    }
+
+    InflateBackend Inflater::getDefaultBackend() {
+        return defaultBackend;
+    }
+
+    // converts an InflateBackend into a human-readable string
+    const char * Inflater::backendToString(InflateBackend backend) {
+        if (backend == inflateZlibNg) return "zlib-ng";
+        if (backend == inflateLibdeflate) return "libdeflate";
+        return "zlib";
+    }
+
+    // ========== private functions ==========
+
+    // makes the output buffer at least length bytes large,
+    // keeping the first used bytes
+    void Inflater::growBuffer(unsigned long int length, unsigned long int used) {
+        if (length <= capacity && buffer != NULL) return;
+        char * larger = new char[length];
+        if (buffer != NULL) {
+            memcpy(larger, buffer, used);
+            delete[] buffer;
+        }
+        buffer = larger;
+        capacity = length;
+    }
+
+    // inflates in streaming mode, growing the buffer instead of restarting
+    template <typename Stream, typename InflateFunction>
+    char * Inflater::inflateStreaming(Stream & stream, InflateFunction inflateStep, const unsigned char * in, unsigned long int inLength, unsigned long int * outLength) {
+        stream.next_in = (unsigned char *) in;
+        stream.avail_in = inLength;
+        unsigned long int used = 0;
+        for (;;) { // breaks on end of stream or error
+            stream.next_out = (unsigned char *) buffer + used;
+            stream.avail_out = capacity - used;
+            int result = inflateStep(&stream, Z_NO_FLUSH);
+            used = capacity - stream.avail_out;
+            if (result == Z_STREAM_END) break;
+            if (result != Z_OK && result != Z_BUF_ERROR) {
+                DEBUG printf("ERROR: inflate failed (%i)\n", result);
+                return NULL;
+            }
+            if (stream.avail_out > 0) {
+                // no progress possible, the input is truncated
+                DEBUG printf("ERROR: inflate input ended early\n");
+                return NULL;
+            }
+            // output buffer full, continue in a larger one
+            growBuffer(capacity * 2, used);
+        }
+        *outLength = used;
+        return buffer;
+    }
+
+    char * Inflater::inflateWithZlib(const unsigned char * in, unsigned long int inLength, unsigned long int * outLength) {
+        if (!initialized) {
+            // 32: detect zlib or gzip header
+            int result = inflateInit2(&stream, 32 + MAX_WBITS);
+            if (result != Z_OK) {
+                printf("ERROR: inflateInit2 failed (%i)\n", result);
+                return NULL;
+            }
+            initialized = true;
+        }
+        else inflateReset(&stream);
+        return inflateStreaming(stream, ::inflate, in, inLength, outLength);
+    }
+
+    char * Inflater::inflateWithZlibNg(const unsigned char * in, unsigned long int inLength, unsigned long int * outLength) {
+#ifdef NBT_WITH_ZLIB_NG
+        if (!ngInitialized) {
+            // 32: detect zlib or gzip header
+            int result = zng_inflateInit2(&ngStream, 32 + MAX_WBITS);
+            if (result != Z_OK) {
+                printf("ERROR: zng_inflateInit2 failed (%i)\n", result);
+                return NULL;
+            }
+            ngInitialized = true;
+        }
+        else zng_inflateReset(&ngStream);
+        return inflateStreaming(ngStream, zng_inflate, in, inLength, outLength);
+#else
+        return inflateWithZlib(in, inLength, outLength);
+#endif
+    }
+
+    // libdeflate only decompresses in one go, region chunks store their exact compressed length, which is all it needs
+    // it cannot continue in a larger buffer, if the output does not fit it starts over from the beginning,
+    // so the first buffer is sized from sizeHint (or the gzip trailer, see inflate()),
+    // else generously from the compressed length, chunks shrink about 1:4 to 1:10
+    char * Inflater::inflateWithLibdeflate(const unsigned char * in, unsigned long int inLength, unsigned long int * outLength, unsigned long int sizeHint) {
+#ifdef NBT_WITH_LIBDEFLATE
+        if (decompressor == NULL) decompressor = libdeflate_alloc_decompressor();
+        if (decompressor == NULL) {
+            printf("ERROR: libdeflate_alloc_decompressor failed\n");
+            return NULL;
+        }
+        bool gzip = inLength >= 2 && in[0] == 0x1f && in[1] == 0x8b;
+        if (sizeHint == 0) growBuffer(inLength * 16, 0);
+        for (;;) { // breaks on success or error
+            size_t length = 0;
+            enum libdeflate_result result = gzip
+                ? libdeflate_gzip_decompress(decompressor, in, inLength, buffer, capacity, &length)
+                : libdeflate_zlib_decompress(decompressor, in, inLength, buffer, capacity, &length);
+            if (result == LIBDEFLATE_SUCCESS) {
+                *outLength = length;
+                return buffer;
+            }
+            if (result != LIBDEFLATE_INSUFFICIENT_SPACE) {
+                DEBUG printf("ERROR: libdeflate failed (%i)\n", (int) result);
+                return NULL;
+            }
+            // each restart costs a whole decompression, so grow a lot at once
+            growBuffer(capacity * 4, 0);
+        }
+#else
+        (void) sizeHint;
+        return inflateWithZlib(in, inLength, outLength);
+#endif
+    }
+
+}
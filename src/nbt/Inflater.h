@@ -0,0 +1,113 @@
+/* Inflater.h
+ *
+ * A reusable decompressor for zlib and gzip data
+ *
+ * Keeps its decompression state and a growing output buffer between calls,
+ * so decompressing many chunks does not allocate for every chunk.
+ * Each thread uses its own Inflater, see Inflater::forThread().
+ *
+ * Besides stock zlib, faster backends can be compiled in:
+ * - libdeflate: define NBT_WITH_LIBDEFLATE and link with -ldeflate
+ * - zlib-ng (native API): define NBT_WITH_ZLIB_NG and link with -lz-ng
+ * The fastest available backend is used, unless another one is selected
+ * with Inflater::setDefaultBackend() or the NBT_INFLATE environment variable
+ * ("zlib", "zlib-ng", or "libdeflate").
+ *
+ * by Gjum <gjum42@gmail.com>
+ */
+#ifndef NBT_INFLATER_H
+#define NBT_INFLATER_H
+
+#include <zlib.h>
+#ifdef NBT_WITH_ZLIB_NG
+#include <zlib-ng.h>
+#endif
+#ifdef NBT_WITH_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+namespace NBT {
+
+    enum InflateBackend {
+        inflateZlib,
+        inflateZlibNg,
+        inflateLibdeflate
+    };
+
+    class Inflater {
+        public:
+            // uses the default backend at the time of construction
+            Inflater();
+            ~Inflater();
+
+            // decompresses zlib or gzip data (detected from the header)
+            // the result stays in the output buffer until the next call
+            // sizeHint is the expected decompressed size if known, or 0 (gzip data has it in its trailer)
+            // NULL on error, outLength is set to the decompressed size
+            char * inflate(const unsigned char * in, unsigned long int inLength, unsigned long int * outLength, unsigned long int sizeHint = 0);
+
+            // hands the output buffer to the caller, who has to delete[] it
+            // the next call allocates a new one of the initial capacity, not of the largest output so far
+            char * releaseBuffer();
+
+            // a buffer of at least length bytes for reading compressed data into,
+            // reused between calls like the output buffer
+            unsigned char * getInputBuffer(unsigned long int length);
+
+            InflateBackend getBackend() const;
+
+            // false if the backend is not compiled in
+            bool setBackend(InflateBackend backend);
+
+            // the Inflater of the calling thread
+            static Inflater & forThread();
+
+            // true if the backend is compiled in
+            static bool isAvailable(InflateBackend backend);
+
+            // the backend of Inflaters created from now on,
+            // set it before starting threads that read chunks
+            // false if the backend is not compiled in
+            static bool setDefaultBackend(InflateBackend backend);
+            static InflateBackend getDefaultBackend();
+
+            // converts an InflateBackend into a human-readable string
+            static const char * backendToString(InflateBackend backend);
+
+        private:
+            InflateBackend backend;
+            char * buffer;
+            unsigned long int capacity;
+            unsigned char * input;
+            unsigned long int inputCapacity;
+
+            z_stream stream;
+            bool initialized;
+#ifdef NBT_WITH_ZLIB_NG
+            zng_stream ngStream;
+            bool ngInitialized;
+#endif
+#ifdef NBT_WITH_LIBDEFLATE
+            struct libdeflate_decompressor * decompressor;
+#endif
+
+            // makes the output buffer at least length bytes large,
+            // keeping the first used bytes
+            void growBuffer(unsigned long int length, unsigned long int used);
+
+            // backend implementations of inflate()
+            char * inflateWithZlib(const unsigned char * in, unsigned long int inLength, unsigned long int * outLength);
+            char * inflateWithZlibNg(const unsigned char * in, unsigned long int inLength, unsigned long int * outLength);
+            char * inflateWithLibdeflate(const unsigned char * in, unsigned long int inLength, unsigned long int * outLength, unsigned long int sizeHint);
+
+            // inflates in streaming mode, growing the buffer instead of restarting
+            template <typename Stream, typename InflateFunction>
+            char * inflateStreaming(Stream & stream, InflateFunction inflateStep, const unsigned char * in, unsigned long int inLength, unsigned long int * outLength);
+
+            Inflater(const Inflater &);             // not copyable
+            Inflater & operator=(const Inflater &); // the buffers are owned
+    };
+
+}
+
+#endif
@@ -0,0 +1,169 @@
+/* Reader.cpp
+ *
+ * Walks NBT data and reports its content to a Visitor
+ * without building a Tag tree.
+ *
+ * by Gjum <gjum42@gmail.com>
+ */
+
+#include "Reader.h"
+#include "Region.h"
+
+//#define DEBUG if (1)
+#ifndef DEBUG
+#define DEBUG if (0)
+#endif
+
+namespace NBT {
+
+    // reads the tag at the cursor of data and reports it to the visitor
+    // false if the visitor stopped or the data is invalid
+    bool Reader::visit(Bytestream * data, Visitor * visitor) {
+        if (!data->require(1)) return false;
+        TagType type = static_cast<TagType>(data->get());
+        if (type == tagTypeEnd) return true;
+        if (!data->require(2)) return false;
+        uint16_t nameSize = 0;
+        data->getInverseEndian(&nameSize, 2);
+        if (!data->require(nameSize)) {
+            printf("ERROR: invalid name size %i\n", nameSize);
+            return false;
+        }
+        if (data->source != NULL) {
+            // the window moves when it is refilled while reading the payload, so keep a copy of the name
+            std::string name(data->data + data->cursor, nameSize);
+            data->cursor += nameSize;
+            return visitPayload(type, name.data(), nameSize, data, visitor);
+        }
+        const char * name = data->data + data->cursor;
+        data->cursor += nameSize;
+        return visitPayload(type, name, nameSize, data, visitor);
+    }
+
+    // reads an uncompressed or gzipped file and reports it to the visitor
+    // the file is inflated while reading, only the largest tag is held at once
+    bool Reader::visitFile(std::string path, Visitor * visitor) {
+        Bytestream data;
+        if (data.openFile(path)->data == NULL) return false;
+        return visit(&data, visitor);
+    }
+
+    // reads the chunk at (x,z) of the world at the path and reports it to the visitor
+    bool Reader::visitChunk(std::string worldpath, long int chunkx, long int chunkz, Visitor * visitor) {
+        RegionFile region;
+        if (!region.open(RegionFile::getPath(worldpath, chunkx, chunkz))) return false;
+        Bytestream data;
+        if (region.readChunk(chunkx, chunkz, &data, false)->data == NULL) return false;
+        return visit(&data, visitor);
+    }
+
+    // gets the ith value of the array passed to Visitor::array()
+    int64_t Reader::getArrayItem(TagType type, const char * values, int32_t i) {
+        if (type == tagTypeByteArray) return (int8_t) values[i];
+        if (type == tagTypeIntArray) return loadBigEndian32(values + 4*i);
+        if (type == tagTypeLongArray) return loadBigEndian64(values + 8*i);
+        return 0;
+    }
+
+    // reads the payload and reports it, false to stop
+    bool Reader::visitPayload(TagType type, const char * name, uint16_t nameLength, Bytestream * data, Visitor * visitor) {
+        VisitResult result = visitContinue;
+        unsigned int size = Tag::fixedPayloadSize(type);
+        if (size > 0) {
+            if (!data->require(size)) return false;
+            Payload value;
+            value.tagInt = 0;
+            if (type == tagTypeByte) value.tagInt = (int8_t) data->get();
+            else if (type == tagTypeShort) {
+                int16_t v = 0;
+                data->getInverseEndian(&v, 2);
+                value.tagInt = v;
+            }
+            else if (type == tagTypeInt) {
+                int32_t v = 0;
+                data->getInverseEndian(&v, 4);
+                value.tagInt = v;
+            }
+            else if (type == tagTypeLong) {
+                int64_t v = 0;
+                data->getInverseEndian(&v, 8);
+                value.tagInt = v;
+            }
+            else if (type == tagTypeFloat) {
+                float v = 0;
+                data->getInverseEndian(&v, 4);
+                value.tagFloat = v;
+            }
+            else if (type == tagTypeDouble) {
+                double v = 0;
+                data->getInverseEndian(&v, 8);
+                value.tagFloat = v;
+            }
+            result = visitor->scalar(name, nameLength, type, value);
+        }
+        else if (type == tagTypeString) {
+            if (!data->require(2)) return false;
+            uint16_t strLen = 0;
+            data->getInverseEndian(&strLen, 2);
+            if (!data->require(strLen)) return false;
+            const char * value = data->data + data->cursor;
+            data->cursor += strLen;
+            result = visitor->string(name, nameLength, value, strLen);
+        }
+        else if (Tag::arrayValueSize(type) > 0) {
+            if (!data->require(4)) return false;
+            int32_t count = 0;
+            data->getInverseEndian(&count, 4);
+            unsigned long int bytes = (unsigned long int) count * Tag::arrayValueSize(type);
+            if (count < 0 || !data->require(bytes)) return false;
+            const char * values = data->data + data->cursor;
+            data->cursor += bytes;
+            result = visitor->array(name, nameLength, type, values, count);
+        }
+        else if (type == tagTypeList) {
+            if (!data->require(5)) return false;
+            TagType listType = static_cast<TagType>(data->get());
+            int32_t count = 0;
+            data->getInverseEndian(&count, 4);
+            if (count < 0) return false;
+            result = visitor->beginList(name, nameLength, listType, count);
+            if (result == visitStop) return false;
+            if (result == visitSkip) return skipListItems(listType, count, data);
+            for (int32_t i = 0; i < count; i++)
+                if (!visitPayload(listType, NULL, 0, data, visitor)) return false;
+            result = visitor->endList();
+        }
+        else if (type == tagTypeCompound) {
+            result = visitor->beginCompound(name, nameLength);
+            if (result == visitStop) return false;
+            if (result == visitSkip) {
+                // the cursor is behind the name, like before a compound payload
+                return Tag::skipPayload(tagTypeCompound, data);
+            }
+            for (;;) { // breaks on TAG_End
+                if (!data->require(1)) return false;
+                if (data->data[data->cursor] == tagTypeEnd) {
+                    data->cursor++;
+                    break;
+                }
+                if (!visit(data, visitor)) return false;
+            }
+            result = visitor->endCompound();
+        }
+        else {
+            printf("ERROR: unknown type %i %#x\n", (int) type, (int) type);
+            return false;
+        }
+        return result != visitStop;
+    }
+
+    // skips the remaining items of a list after its header
+    bool Reader::skipListItems(TagType listType, int32_t size, Bytestream * data) {
+        unsigned long int valueSize = Tag::fixedPayloadSize(listType);
+        if (valueSize > 0) return data->skip(size * valueSize);
+        for (int32_t i = 0; i < size; i++)
+            if (!Tag::skipPayload(listType, data)) return false;
+        return true;
+    }
+
+}
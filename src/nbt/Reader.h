@@ -0,0 +1,89 @@
+/* Reader.h
+ *
+ * Walks NBT data and reports its content to a Visitor
+ * without building a Tag tree.
+ *
+ * Names and strings are passed as pointer and length into the Bytestream,
+ * they are not null-terminated and only valid during the call.
+ *
+ * by Gjum <gjum42@gmail.com>
+ */
+#ifndef NBT_READER_H
+#define NBT_READER_H
+
+#include "Tag.h"
+
+namespace NBT {
+
+    // what the Reader should do after an event
+    enum VisitResult {
+        visitContinue, // go on, descend into a begun compound or list
+        visitSkip,     // skip the begun compound or list, no end event follows
+        visitStop      // stop reading
+    };
+
+    // receives the events of a Reader
+    // all events continue by default, override the interesting ones
+    // list items have no name (NULL, 0)
+    class Visitor {
+        public:
+            virtual ~Visitor() {}
+
+            virtual VisitResult beginCompound(const char * /*name*/, uint16_t /*nameLength*/) {
+                return visitContinue;
+            }
+
+            virtual VisitResult endCompound() {
+                return visitContinue;
+            }
+
+            virtual VisitResult beginList(const char * /*name*/, uint16_t /*nameLength*/, TagType /*listType*/, int32_t /*size*/) {
+                return visitContinue;
+            }
+
+            virtual VisitResult endList() {
+                return visitContinue;
+            }
+
+            // value.tagInt is set for integer types, value.tagFloat for floating point types
+            virtual VisitResult scalar(const char * /*name*/, uint16_t /*nameLength*/, TagType /*type*/, Payload /*value*/) {
+                return visitContinue;
+            }
+
+            virtual VisitResult string(const char * /*name*/, uint16_t /*nameLength*/, const char * /*value*/, uint16_t /*valueLength*/) {
+                return visitContinue;
+            }
+
+            // values are big-endian, use Reader::getArrayItem() to read them
+            virtual VisitResult array(const char * /*name*/, uint16_t /*nameLength*/, TagType /*type*/, const char * /*values*/, int32_t /*size*/) {
+                return visitContinue;
+            }
+    };
+
+    class Reader {
+        public:
+            // reads the tag at the cursor of data and reports it to the visitor
+            // the cursor is behind the tag afterwards, unless reading was stopped
+            // false if the visitor stopped or the data is invalid
+            static bool visit(Bytestream * data, Visitor * visitor);
+
+            // reads an uncompressed or gzipped file and reports it to the visitor
+            static bool visitFile(std::string path, Visitor * visitor);
+
+            // reads the chunk at (x,z) of the world at the path and reports it to the visitor
+            static bool visitChunk(std::string worldpath, long int chunkx, long int chunkz, Visitor * visitor);
+
+            // gets the ith value of the array passed to Visitor::array()
+            static int64_t getArrayItem(TagType type, const char * values, int32_t i);
+
+        private:
+            // reads the payload and reports it, false to stop
+            static bool visitPayload(TagType type, const char * name, uint16_t nameLength, Bytestream * data, Visitor * visitor);
+
+            // skips the remaining items of a list after its header
+            static bool skipListItems(TagType listType, int32_t size, Bytestream * data);
+    };
+
+}
+
+#endif
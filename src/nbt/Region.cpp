@@ -0,0 +1,662 @@
+/* Region.cpp
+ *
+ * Classes for reading and writing chunks of region (.mca) files
+ *
+ * by Gjum <gjum42@gmail.com>
+ */
+
+#include "Region.h"
+#include "Inflater.h"
+
+#include <algorithm>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+
+//#define DEBUG if (1)
+#ifndef DEBUG
+#define DEBUG if (0)
+#endif
+
+namespace NBT {
+
+    //========== RegionFile ==========
+
+    RegionFile::RegionFile() {
+        fd = -1;
+        map = NULL;
+        mapLength = 0;
+        writable = false;
+        memset(locations, 0, sizeof(locations));
+        memset(timestamps, 0, sizeof(timestamps));
+    }
+
+    RegionFile::~RegionFile() {
+        close();
+    }
+
+    // opens the region file and reads its header
+    // if mapped is set, the whole file is mapped into memory
+    // and read ahead, chunks are decompressed straight from the mapping
+    // false if the file could not be opened
+    bool RegionFile::open(std::string path, bool mapped) {
+        close();
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            DEBUG printf("ERROR: Could not open region '%s'\n", path.c_str());
+            return false;
+        }
+        struct stat info;
+        if (mapped && fstat(fd, &info) == 0 && info.st_size >= 8192) {
+            void * mapping = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping != MAP_FAILED) {
+                map = (const unsigned char *) mapping;
+                mapLength = info.st_size;
+                // chunks are usually read in file order, let the kernel read ahead
+                madvise(mapping, mapLength, MADV_SEQUENTIAL);
+                madvise(mapping, mapLength, MADV_WILLNEED);
+            }
+            else DEBUG printf("Could not map region '%s', reading it instead\n", path.c_str());
+        }
+        readHeader(path);
+        return true;
+    }
+
+    // opens or creates the region file for reading and writing chunks
+    // the chunks are not mapped, other RegionFiles of the same file
+    // do not see the changes
+    // false if the file could not be opened or created
+    bool RegionFile::openForWriting(std::string path) {
+        close();
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            printf("ERROR: Could not open region '%s' for writing\n", path.c_str());
+            return false;
+        }
+        // new or truncated regions get an empty header
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (info.st_size < 8192 && ftruncate(fd, 8192) != 0)) {
+            printf("ERROR: Could not create header of region '%s'\n", path.c_str());
+            close();
+            return false;
+        }
+        if (!readHeader(path)) {
+            close();
+            return false;
+        }
+        writable = true;
+        findUsedSectors();
+        return true;
+    }
+
+    void RegionFile::close() {
+        if (map != NULL) munmap((void *) map, mapLength);
+        map = NULL;
+        mapLength = 0;
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        writable = false;
+        usedSectors.clear();
+        memset(locations, 0, sizeof(locations));
+        memset(timestamps, 0, sizeof(timestamps));
+    }
+
+    bool RegionFile::isOpen() const {
+        return fd >= 0;
+    }
+
+    // builds the path of the region containing the chunk at (x,z)
+    std::string RegionFile::getPath(std::string worldpath, long int chunkx, long int chunkz) {
+        return worldpath + "/region/r." + std::to_string(chunkx >> 5) + "." + std::to_string(chunkz >> 5) + ".mca";
+    }
+
+    // index of the chunk in the region header, coordinates may be absolute
+    unsigned int RegionFile::getChunkID(long int chunkx, long int chunkz) {
+        return (chunkx & 31) + (chunkz & 31) * 32;
+    }
+
+    // first sector of the chunk, 0 if not present
+    uint32_t RegionFile::getChunkOffset(long int chunkx, long int chunkz) const {
+        return locations[getChunkID(chunkx, chunkz)] >> 8;
+    }
+
+    // number of sectors of the chunk, 0 if not present
+    uint32_t RegionFile::getChunkSectors(long int chunkx, long int chunkz) const {
+        return locations[getChunkID(chunkx, chunkz)] & 0xff;
+    }
+
+    // last modification of the chunk in seconds since the epoch, 0 if not present
+    uint32_t RegionFile::getChunkTimestamp(long int chunkx, long int chunkz) const {
+        return timestamps[getChunkID(chunkx, chunkz)];
+    }
+
+    // reads and decompresses the chunk at (x,z) into data
+    // data is NULL if the chunk is not present or any other error occured
+    // if owned is false, data borrows the buffer of the thread's Inflater,
+    // it is only valid until the next chunk is read on this thread
+    // TODO check if chunk is populated or empty
+    Bytestream * RegionFile::readChunk(long int chunkx, long int chunkz, Bytestream * data, bool owned) const {
+        uint32_t chunkPos = getChunkOffset(chunkx, chunkz);
+        uint32_t sectors  = getChunkSectors(chunkx, chunkz);
+        DEBUG printf("chunk %li %li: sector %u, %u sectors\n", chunkx, chunkz, chunkPos, sectors);
+        if (fd < 0 || chunkPos == 0 || sectors == 0) return data->loadFromByteArray(NULL, 0);
+
+        // read chunk header
+        unsigned char headerBuffer[5];
+        const unsigned char * chunkHeader = headerBuffer;
+        if (map != NULL) {
+            if ((size_t) chunkPos*4096 + 5 > mapLength) return data->loadFromByteArray(NULL, 0);
+            chunkHeader = map + (size_t) chunkPos*4096;
+        }
+        else if (pread(fd, headerBuffer, 5, (off_t) chunkPos*4096) != 5)
+            return data->loadFromByteArray(NULL, 0);
+        uint32_t lengthCompressed = (uint32_t(chunkHeader[0]) << 24) | (uint32_t(chunkHeader[1]) << 16)
+                                  | (uint32_t(chunkHeader[2]) << 8) | chunkHeader[3];
+        unsigned char compression = chunkHeader[4];
+        // the length includes the compression byte, but not the 4 bytes of the length itself
+        if (lengthCompressed <= 1 || lengthCompressed > sectors*4096 - 4) {
+            DEBUG printf("ERROR: invalid length %u of chunk %li %li\n", lengthCompressed, chunkx, chunkz);
+            return data->loadFromByteArray(NULL, 0);
+        }
+        lengthCompressed -= 1;
+        if (compression != 1 && compression != 2) { // gzip or zlib
+            printf("ERROR: unsupported compression %i of chunk %li %li\n", compression, chunkx, chunkz);
+            return data->loadFromByteArray(NULL, 0);
+        }
+
+        // decompress straight from the mapping
+        if (map != NULL) {
+            if ((size_t) chunkPos*4096 + 5 + lengthCompressed > mapLength) return data->loadFromByteArray(NULL, 0);
+            return inflateChunk(map + (size_t) chunkPos*4096 + 5, lengthCompressed, data, owned);
+        }
+
+        // read compressed chunk data into the reused input buffer
+        unsigned char * bufferCompressed = Inflater::forThread().getInputBuffer(lengthCompressed);
+        if (pread(fd, bufferCompressed, lengthCompressed, (off_t) chunkPos*4096+5) != (ssize_t) lengthCompressed)
+            return data->loadFromByteArray(NULL, 0);
+        return inflateChunk(bufferCompressed, lengthCompressed, data, owned);
+    }
+
+    // compresses the uncompressed NBT data and writes it as the chunk at (x,z)
+    // timestamp 0 means now
+    // false on error or if not opened for writing
+    bool RegionFile::writeChunk(long int chunkx, long int chunkz, const char * data, unsigned long int length, uint32_t timestamp) {
+        std::vector<char> record;
+        if (!compressChunk(data, length, &record)) return false;
+        return writeCompressedChunk(chunkx, chunkz, record, timestamp);
+    }
+
+    // writes a record made by compressChunk() as the chunk at (x,z)
+    // in place if it fits into the chunk's sectors, else into the first free ones
+    // timestamp 0 means now
+    // false on error or if not opened for writing
+    bool RegionFile::writeCompressedChunk(long int chunkx, long int chunkz, const std::vector<char> & record, uint32_t timestamp) {
+        if (!writable) {
+            printf("ERROR: region not opened for writing\n");
+            return false;
+        }
+        unsigned long int sectors = (record.size() + 4095) / 4096;
+        if (sectors == 0 || sectors > 255) {
+            printf("ERROR: chunk %li %li too large (%lu bytes)\n", chunkx, chunkz, (unsigned long int) record.size());
+            return false;
+        }
+        unsigned int chunkID = getChunkID(chunkx, chunkz);
+        uint32_t oldOffset  = locations[chunkID] >> 8;
+        uint32_t oldSectors = locations[chunkID] & 0xff;
+        // the old sectors stay used until the chunk is written elsewhere
+        uint32_t offset = oldOffset;
+        if (oldOffset < 2 || sectors > oldSectors) offset = findFreeSectors(sectors);
+        DEBUG printf("writing chunk %li %li: sector %u, %lu sectors (was %u, %u)\n", chunkx, chunkz, offset, sectors, oldOffset, oldSectors);
+
+        // pad to whole sectors, so the file stays a multiple of the sector size
+        static const char zeros[4096] = {0};
+        unsigned long int padding = sectors*4096 - record.size();
+        if (pwrite(fd, record.data(), record.size(), (off_t) offset*4096) != (ssize_t) record.size()
+                || (padding > 0 && pwrite(fd, zeros, padding, (off_t) offset*4096 + record.size()) != (ssize_t) padding)) {
+            printf("ERROR: Could not write chunk %li %li\n", chunkx, chunkz);
+            return false;
+        }
+        if (timestamp == 0) timestamp = time(NULL);
+        if (!writeHeaderEntry(chunkID, (offset << 8) | sectors, timestamp)) return false;
+
+        // free the old sectors, then mark the new ones, they may overlap
+        if (oldOffset >= 2) markSectors(oldOffset, oldSectors, false);
+        markSectors(offset, sectors, true);
+        return true;
+    }
+
+    // writes all chunks of the region at once: the sectors are allocated first,
+    // adjacent chunks are written with one pwritev() in file order,
+    // then the header is written and the file is synced once
+    // the sectors of moved chunks are only reused by later writes
+    // each chunk may only be contained once
+    // chunks too large for a region are skipped, the others are still written
+    // false on error, if a chunk was skipped, or if not opened for writing
+    bool RegionFile::writeCompressedChunks(const std::vector<ChunkRecord> & chunks, bool sync) {
+        if (!writable) {
+            printf("ERROR: region not opened for writing\n");
+            return false;
+        }
+        struct Placement {
+            uint32_t offset, sectors;
+            const ChunkRecord * chunk;
+            bool operator<(const Placement & other) const { return offset < other.offset; }
+        };
+        std::vector<Placement> placements;
+        bool success = true;
+        bool skipped = false;
+        // the old sectors stay used, the header still points to them until the end
+        for (size_t i = 0; i < chunks.size(); i++) {
+            const ChunkRecord & chunk = chunks[i];
+            Placement placement;
+            placement.chunk = &chunk;
+            placement.sectors = (chunk.record.size() + 4095) / 4096;
+            if (placement.sectors == 0 || placement.sectors > 255) {
+                printf("ERROR: chunk %li %li too large (%lu bytes)\n", chunk.chunkx, chunk.chunkz, (unsigned long int) chunk.record.size());
+                skipped = true; // the other chunks are still written
+                continue;
+            }
+            uint32_t location = locations[getChunkID(chunk.chunkx, chunk.chunkz)];
+            placement.offset = location >> 8;
+            if (placement.offset < 2 || placement.sectors > (location & 0xff)) {
+                placement.offset = findFreeSectors(placement.sectors);
+                markSectors(placement.offset, placement.sectors, true);
+            }
+            placements.push_back(placement);
+        }
+        std::sort(placements.begin(), placements.end());
+
+        // write runs of adjacent chunks at once, each padded to whole sectors
+        static const char zeros[4096] = {0};
+        std::vector<struct iovec> iov;
+        uint32_t runStart = 0, runEnd = 0;
+        unsigned long int runBytes = 0;
+        for (size_t i = 0; i <= placements.size() && success; i++) {
+            bool last = i == placements.size();
+            if (!iov.empty() && (last || placements[i].offset != runEnd || iov.size() + 2 > IOV_MAX)) {
+                DEBUG printf("writing sectors %u to %u in %lu pieces\n", runStart, runEnd, (unsigned long int) iov.size());
+                if (pwritev(fd, iov.data(), iov.size(), (off_t) runStart*4096) != (ssize_t) runBytes) {
+                    printf("ERROR: Could not write chunks\n");
+                    success = false;
+                }
+                iov.clear();
+                runBytes = 0;
+            }
+            if (last) break;
+            const Placement & placement = placements[i];
+            if (iov.empty()) runStart = runEnd = placement.offset;
+            struct iovec piece;
+            piece.iov_base = (void *) placement.chunk->record.data();
+            piece.iov_len = placement.chunk->record.size();
+            iov.push_back(piece);
+            unsigned long int padding = placement.sectors*4096 - placement.chunk->record.size();
+            if (padding > 0) {
+                piece.iov_base = (void *) zeros;
+                piece.iov_len = padding;
+                iov.push_back(piece);
+            }
+            runBytes += placement.sectors*4096;
+            runEnd += placement.sectors;
+        }
+        if (!success) {
+            findUsedSectors(); // forget the allocations
+            return false;
+        }
+
+        // point the header to the new sectors and free the old ones
+        uint32_t now = time(NULL);
+        for (size_t i = 0; i < placements.size(); i++) {
+            unsigned int chunkID = getChunkID(placements[i].chunk->chunkx, placements[i].chunk->chunkz);
+            if ((locations[chunkID] >> 8) >= 2) markSectors(locations[chunkID] >> 8, locations[chunkID] & 0xff, false);
+            locations[chunkID] = (placements[i].offset << 8) | placements[i].sectors;
+            timestamps[chunkID] = placements[i].chunk->timestamp != 0 ? placements[i].chunk->timestamp : now;
+        }
+        for (size_t i = 0; i < placements.size(); i++)
+            markSectors(placements[i].offset, placements[i].sectors, true);
+        unsigned char header[8192];
+        for (int i = 0; i < 1024; i++) {
+            unsigned char * loc = header + 4*i;
+            unsigned char * time = header + 4096 + 4*i;
+            loc[0]  = locations[i] >> 24;  loc[1]  = locations[i] >> 16;  loc[2]  = locations[i] >> 8;  loc[3]  = locations[i];
+            time[0] = timestamps[i] >> 24; time[1] = timestamps[i] >> 16; time[2] = timestamps[i] >> 8; time[3] = timestamps[i];
+        }
+        if (pwrite(fd, header, sizeof(header), 0) != sizeof(header)) {
+            printf("ERROR: Could not write region header\n");
+            return false;
+        }
+        if (sync && fsync(fd) != 0) {
+            printf("ERROR: Could not sync region\n");
+            return false;
+        }
+        return !skipped;
+    }
+
+    // zlib compresses the uncompressed NBT data into a chunk record
+    // (length, compression type, and compressed data)
+    // false on error
+    bool RegionFile::compressChunk(const char * data, unsigned long int length, std::vector<char> * record, int level) {
+        uLongf compressedLength = compressBound(length);
+        record->resize(5 + compressedLength);
+        int result = compress2((Bytef *) record->data() + 5, &compressedLength, (const Bytef *) data, length, level);
+        if (result != Z_OK) {
+            printf("ERROR: Could not compress chunk (%i)\n", result);
+            record->clear();
+            return false;
+        }
+        record->resize(5 + compressedLength);
+        // the length includes the compression byte
+        uint32_t recordLength = compressedLength + 1;
+        unsigned char * header = (unsigned char *) record->data();
+        header[0] = recordLength >> 24;
+        header[1] = recordLength >> 16;
+        header[2] = recordLength >> 8;
+        header[3] = recordLength;
+        header[4] = 2; // zlib
+        return true;
+    }
+
+    // moves all chunks to the front of the file, in file order and without gaps,
+    // and truncates the file behind the last chunk
+    // not crash safe, a chunk may be lost if interrupted while moving it
+    // false on error or if not opened for writing
+    bool RegionFile::compact() {
+        if (!writable) {
+            printf("ERROR: region not opened for writing\n");
+            return false;
+        }
+        std::vector<unsigned int> chunkIDs;
+        for (unsigned int i = 0; i < 1024; i++)
+            if ((locations[i] >> 8) >= 2 && (locations[i] & 0xff) > 0) chunkIDs.push_back(i);
+        std::sort(chunkIDs.begin(), chunkIDs.end(), [this](unsigned int a, unsigned int b) {
+            return locations[a] < locations[b];
+        });
+        // chunks only move towards the front, so no unmoved chunk is overwritten
+        uint32_t next = 2;
+        std::vector<char> sectorData;
+        for (size_t i = 0; i < chunkIDs.size(); i++) {
+            unsigned int chunkID = chunkIDs[i];
+            uint32_t offset  = locations[chunkID] >> 8;
+            uint32_t sectors = locations[chunkID] & 0xff;
+            if (offset < next) {
+                printf("ERROR: chunk %u overlaps another chunk, not compacting further\n", chunkID);
+                return false;
+            }
+            if (offset > next) {
+                sectorData.assign(sectors*4096, 0);
+                if (pread(fd, sectorData.data(), sectorData.size(), (off_t) offset*4096) < 0
+                        || pwrite(fd, sectorData.data(), sectorData.size(), (off_t) next*4096) != (ssize_t) sectorData.size()
+                        || !writeHeaderEntry(chunkID, (next << 8) | sectors, timestamps[chunkID])) {
+                    printf("ERROR: Could not move chunk %u\n", chunkID);
+                    findUsedSectors();
+                    return false;
+                }
+            }
+            next += sectors;
+        }
+        if (ftruncate(fd, (off_t) next*4096) != 0) {
+            printf("ERROR: Could not truncate region\n");
+            return false;
+        }
+        findUsedSectors();
+        return true;
+    }
+
+    // decompresses the chunk data following the chunk header into data
+    Bytestream * RegionFile::inflateChunk(const unsigned char * bufferCompressed, uint32_t lengthCompressed, Bytestream * data, bool owned) const {
+        Inflater & inflater = Inflater::forThread();
+        unsigned long int lengthUncompressed = 0;
+        char * bufferUncompressed = inflater.inflate(bufferCompressed, lengthCompressed, &lengthUncompressed);
+        if (bufferUncompressed == NULL) {
+            //printf("Error in region file! Could not inflate chunk\n");
+            return data->loadFromByteArray(NULL, 0);
+        }
+        if (owned) bufferUncompressed = inflater.releaseBuffer();
+        data->loadFromByteArray(bufferUncompressed, lengthUncompressed);
+        data->ownsData = owned;
+        return data;
+    }
+
+    // reads the location and timestamp tables from the header
+    // false if the file has no complete header
+    bool RegionFile::readHeader(const std::string & path) {
+        // both tables are big-endian
+        unsigned char headerBuffer[8192];
+        const unsigned char * header = map;
+        if (header == NULL) {
+            ssize_t bytesRead = pread(fd, headerBuffer, sizeof(headerBuffer), 0);
+            if (bytesRead != sizeof(headerBuffer)) {
+                // empty or truncated region, no chunks
+                DEBUG printf("Region '%s' has no complete header\n", path.c_str());
+                return false;
+            }
+            header = headerBuffer;
+        }
+        for (int i = 0; i < 1024; i++) {
+            const unsigned char * loc = header + 4*i;
+            const unsigned char * time = header + 4096 + 4*i;
+            locations[i]  = (uint32_t(loc[0]) << 24) | (uint32_t(loc[1]) << 16) | (uint32_t(loc[2]) << 8) | loc[3];
+            timestamps[i] = (uint32_t(time[0]) << 24) | (uint32_t(time[1]) << 16) | (uint32_t(time[2]) << 8) | time[3];
+        }
+        return true;
+    }
+
+    // marks the header and chunk sectors in usedSectors
+    void RegionFile::findUsedSectors() {
+        struct stat info;
+        unsigned long int fileSectors = 2;
+        if (fstat(fd, &info) == 0) fileSectors = (info.st_size + 4095) / 4096;
+        usedSectors.assign(fileSectors > 2 ? fileSectors : 2, false);
+        usedSectors[0] = usedSectors[1] = true;
+        for (int i = 0; i < 1024; i++) {
+            uint32_t offset  = locations[i] >> 8;
+            uint32_t sectors = locations[i] & 0xff;
+            if (offset >= 2) markSectors(offset, sectors, true);
+        }
+    }
+
+    // first sector of a run of count free sectors,
+    // the run may extend beyond the end of the file
+    uint32_t RegionFile::findFreeSectors(uint32_t count) const {
+        uint32_t run = 0;
+        for (uint32_t i = 2; i < usedSectors.size(); i++) {
+            if (usedSectors[i]) run = 0;
+            else if (++run == count) return i + 1 - count;
+        }
+        // continue the free sectors at the end
+        return usedSectors.size() - run;
+    }
+
+    // writes the location and timestamp of the chunk to the header
+    bool RegionFile::writeHeaderEntry(unsigned int chunkID, uint32_t location, uint32_t timestamp) {
+        unsigned char entry[4];
+        entry[0] = location >> 24;
+        entry[1] = location >> 16;
+        entry[2] = location >> 8;
+        entry[3] = location;
+        if (pwrite(fd, entry, 4, 4*chunkID) != 4) {
+            printf("ERROR: Could not write region header\n");
+            return false;
+        }
+        locations[chunkID] = location;
+        entry[0] = timestamp >> 24;
+        entry[1] = timestamp >> 16;
+        entry[2] = timestamp >> 8;
+        entry[3] = timestamp;
+        if (pwrite(fd, entry, 4, 4096 + 4*chunkID) != 4) {
+            printf("ERROR: Could not write region header\n");
+            return false;
+        }
+        timestamps[chunkID] = timestamp;
+        return true;
+    }
+
+    // marks the sectors as used or free
+    void RegionFile::markSectors(uint32_t offset, uint32_t sectors, bool used) {
+        if (offset + sectors > usedSectors.size()) usedSectors.resize(offset + sectors, false);
+        for (uint32_t i = offset; i < offset + sectors; i++)
+            usedSectors[i] = used;
+    }
+
+    //========== RegionCache ==========
+
+    // keeps at most maxOpen regions of the world open
+    // if mapped is set, regions are mapped into memory (see RegionFile::open)
+    RegionCache::RegionCache(std::string worldpath_, unsigned int maxOpen_, bool mapped_) {
+        worldpath = worldpath_;
+        mapped = mapped_;
+        maxOpen = maxOpen_ > 0 ? maxOpen_ : 1;
+    }
+
+    // gets the region containing the chunk at (x,z), opened if needed
+    // NULL if the world has no such region
+    std::shared_ptr<RegionFile> RegionCache::getRegion(long int chunkx, long int chunkz) {
+        RegionPos pos(chunkx >> 5, chunkz >> 5);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto found = regions.find(pos);
+            if (found != regions.end()) {
+                // mark as most recently used
+                lru.splice(lru.begin(), lru, found->second.lruPos);
+                return found->second.region;
+            }
+        }
+        // opened without the lock, so other threads can use the cache meanwhile
+        std::shared_ptr<RegionFile> region(new RegionFile);
+        if (!region->open(RegionFile::getPath(worldpath, chunkx, chunkz), mapped))
+            region.reset(); // remember that there is no such region
+        std::lock_guard<std::mutex> guard(lock);
+        // another thread may have opened it too, keep the first one
+        auto found = regions.find(pos);
+        if (found != regions.end()) {
+            lru.splice(lru.begin(), lru, found->second.lruPos);
+            return found->second.region;
+        }
+        // evict the least recently used region, threads still using it keep it open
+        if (regions.size() >= maxOpen) {
+            regions.erase(lru.back());
+            lru.pop_back();
+        }
+        lru.push_front(pos);
+        Entry entry;
+        entry.region = region;
+        entry.lruPos = lru.begin();
+        regions[pos] = entry;
+        return region;
+    }
+
+    // reads and decompresses the chunk at (x,z) into data
+    // data is NULL if the chunk is not present or any other error occured
+    // see RegionFile::readChunk() for owned
+    Bytestream * RegionCache::readChunk(long int chunkx, long int chunkz, Bytestream * data, bool owned) {
+        std::shared_ptr<RegionFile> region = getRegion(chunkx, chunkz);
+        if (!region) return data->loadFromByteArray(NULL, 0);
+        return region->readChunk(chunkx, chunkz, data, owned);
+    }
+
+    // closes all regions not in use
+    void RegionCache::clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        regions.clear();
+        lru.clear();
+    }
+
+    //========== ChunkBatch ==========
+
+    // collects chunks to be saved into the regions of the world at the path
+    ChunkBatch::ChunkBatch(std::string worldpath_) {
+        worldpath = worldpath_;
+    }
+
+    // adds the tag as the chunk at (x,z), timestamp 0 means the time of saving
+    // the tag is not copied and has to stay valid until save() returns
+    // adding a chunk again replaces it
+    void ChunkBatch::add(long int chunkx, long int chunkz, const Tag * tag, uint32_t timestamp) {
+        Pending chunk;
+        chunk.chunkx = chunkx;
+        chunk.chunkz = chunkz;
+        chunk.tag = tag;
+        chunk.timestamp = timestamp;
+        pending.push_back(chunk);
+    }
+
+    // number of chunks added since the last save()
+    size_t ChunkBatch::size() const {
+        return pending.size();
+    }
+
+    // serializes and compresses the chunks in parallel, each region is
+    // written by RegionFile::writeCompressedChunks() once all its chunks are ready
+    // the batch is empty afterwards
+    // false if any chunk could not be saved
+    bool ChunkBatch::save(int level) {
+        // group by region, in file header order, the last added of each chunk wins
+        std::stable_sort(pending.begin(), pending.end(), [](const Pending & a, const Pending & b) {
+            if ((a.chunkx >> 5) != (b.chunkx >> 5)) return (a.chunkx >> 5) < (b.chunkx >> 5);
+            if ((a.chunkz >> 5) != (b.chunkz >> 5)) return (a.chunkz >> 5) < (b.chunkz >> 5);
+            return RegionFile::getChunkID(a.chunkx, a.chunkz) < RegionFile::getChunkID(b.chunkx, b.chunkz);
+        });
+        std::vector<Pending> chunks;
+        for (size_t i = 0; i < pending.size(); i++) {
+            if (i+1 < pending.size() && pending[i].chunkx == pending[i+1].chunkx && pending[i].chunkz == pending[i+1].chunkz)
+                continue;
+            chunks.push_back(pending[i]);
+        }
+        pending.clear();
+
+        std::vector<size_t> regionOf(chunks.size());
+        std::vector<size_t> regionStart;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            if (i == 0 || (chunks[i].chunkx >> 5) != (chunks[i-1].chunkx >> 5) || (chunks[i].chunkz >> 5) != (chunks[i-1].chunkz >> 5))
+                regionStart.push_back(i);
+            regionOf[i] = regionStart.size() - 1;
+        }
+        regionStart.push_back(chunks.size());
+        std::vector<std::vector<ChunkRecord> > records(regionStart.size() - 1);
+        std::vector<int> remaining(records.size());
+        for (size_t r = 0; r < records.size(); r++) {
+            records[r].resize(regionStart[r+1] - regionStart[r]);
+            remaining[r] = records[r].size();
+        }
+
+        // compression keeps all threads busy, the thread completing a region writes it
+        int failures = 0;
+#pragma omp parallel for schedule(dynamic) shared(chunks, records, remaining, failures)
+        for (long int i = 0; i < (long int) chunks.size(); i++) {
+            size_t r = regionOf[i];
+            ChunkRecord & record = records[r][i - regionStart[r]];
+            record.chunkx = chunks[i].chunkx;
+            record.chunkz = chunks[i].chunkz;
+            record.timestamp = chunks[i].timestamp;
+            Bytestream * data = chunks[i].tag->writeToBytestream();
+            if (data == NULL || !RegionFile::compressChunk(data->data, data->length, &record.record, level)) {
+#pragma omp atomic
+                failures++;
+            }
+            delete data;
+            int left;
+#pragma omp atomic capture
+            left = --remaining[r];
+            if (left > 0) continue;
+
+            // all chunks of the region are compressed, skip the failed ones
+            std::vector<ChunkRecord> & region = records[r];
+            region.erase(std::remove_if(region.begin(), region.end(), [](const ChunkRecord & c) {
+                return c.record.empty();
+            }), region.end());
+            if (region.empty()) continue;
+            RegionFile file;
+            if (!file.openForWriting(RegionFile::getPath(worldpath, region[0].chunkx, region[0].chunkz))
+                    || !file.writeCompressedChunks(region)) {
+#pragma omp atomic
+                failures += (int) region.size();
+            }
+            std::vector<ChunkRecord>().swap(region); // free the compressed data early
+        }
+        return failures == 0;
+    }
+
+}
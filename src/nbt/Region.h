@@ -0,0 +1,213 @@
+/* Region.h
+ *
+ * Classes for reading and writing chunks of region (.mca) files
+ *
+ * A RegionFile is opened once and keeps the chunk locations and
+ * timestamps of its header in memory. For bulk scans it can map the whole
+ * file and decompress the chunks directly from the page cache.
+ * Opened for writing, it rewrites chunks in place while they fit into their
+ * sectors and moves them to the first free sectors otherwise. The gaps left
+ * behind are only closed by compact().
+ * A RegionCache keeps the regions of a world open for repeated chunk loads,
+ * it can be shared between threads.
+ *
+ * by Gjum <gjum42@gmail.com>
+ */
+#ifndef NBT_REGION_H
+#define NBT_REGION_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "Tag.h"
+
+namespace NBT {
+
+    // a compressed chunk waiting to be written, see RegionFile::writeCompressedChunks()
+    struct ChunkRecord {
+        long int chunkx, chunkz;
+        std::vector<char> record; // made by RegionFile::compressChunk()
+        uint32_t timestamp;       // 0 means now
+    };
+
+    class RegionFile {
+        public:
+            RegionFile();
+            ~RegionFile();
+
+            // opens the region file and reads its header
+            // if mapped is set, the whole file is mapped into memory
+            // and read ahead, chunks are decompressed straight from the mapping
+            // false if the file could not be opened
+            bool open(std::string path, bool mapped = false);
+
+            // opens or creates the region file for reading and writing chunks
+            // the chunks are not mapped, other RegionFiles of the same file
+            // do not see the changes
+            // false if the file could not be opened or created
+            bool openForWriting(std::string path);
+
+            void close();
+
+            bool isOpen() const;
+
+            // builds the path of the region containing the chunk at (x,z)
+            static std::string getPath(std::string worldpath, long int chunkx, long int chunkz);
+
+            // index of the chunk in the region header, coordinates may be absolute
+            static unsigned int getChunkID(long int chunkx, long int chunkz);
+
+            // first sector of the chunk, 0 if not present
+            uint32_t getChunkOffset(long int chunkx, long int chunkz) const;
+
+            // number of sectors of the chunk, 0 if not present
+            uint32_t getChunkSectors(long int chunkx, long int chunkz) const;
+
+            // last modification of the chunk in seconds since the epoch, 0 if not present
+            uint32_t getChunkTimestamp(long int chunkx, long int chunkz) const;
+
+            // reads and decompresses the chunk at (x,z) into data
+            // data is NULL if the chunk is not present or any other error occured
+            // if owned is false, data borrows the buffer of the thread's Inflater,
+            // it is only valid until the next chunk is read on this thread
+            // safe to call from several threads at once
+            Bytestream * readChunk(long int chunkx, long int chunkz, Bytestream * data, bool owned = true) const;
+
+            // compresses the uncompressed NBT data and writes it as the chunk at (x,z)
+            // timestamp 0 means now
+            // false on error or if not opened for writing
+            bool writeChunk(long int chunkx, long int chunkz, const char * data, unsigned long int length, uint32_t timestamp = 0);
+
+            // writes a record made by compressChunk() as the chunk at (x,z)
+            // in place if it fits into the chunk's sectors, else into the first free ones
+            // timestamp 0 means now
+            // false on error or if not opened for writing
+            bool writeCompressedChunk(long int chunkx, long int chunkz, const std::vector<char> & record, uint32_t timestamp = 0);
+
+            // writes all chunks of the region at once: the sectors are allocated first,
+            // adjacent chunks are written with one pwritev() in file order,
+            // then the header is written and the file is synced once
+            // the sectors of moved chunks are only reused by later writes
+            // each chunk may only be contained once
+            // chunks too large for a region are skipped, the others are still written
+            // false on error, if a chunk was skipped, or if not opened for writing
+            bool writeCompressedChunks(const std::vector<ChunkRecord> & chunks, bool sync = true);
+
+            // zlib compresses the uncompressed NBT data into a chunk record
+            // (length, compression type, and compressed data)
+            // false on error
+            static bool compressChunk(const char * data, unsigned long int length, std::vector<char> * record, int level = Z_DEFAULT_COMPRESSION);
+
+            // moves all chunks to the front of the file, in file order and without gaps,
+            // and truncates the file behind the last chunk
+            // not crash safe, a chunk may be lost if interrupted while moving it
+            // false on error or if not opened for writing
+            bool compact();
+
+        private:
+            int fd;
+            const unsigned char * map; // whole file if opened mapped, else NULL
+            size_t mapLength;
+            uint32_t locations[1024];  // sector offset << 8 | sector count
+            uint32_t timestamps[1024];
+            bool writable;
+            std::vector<bool> usedSectors; // if writable, sectors used by the header or a chunk
+
+            // reads the location and timestamp tables from the header
+            // false if the file has no complete header
+            bool readHeader(const std::string & path);
+
+            // marks the header and chunk sectors in usedSectors
+            void findUsedSectors();
+
+            // first sector of a run of count free sectors,
+            // the run may extend beyond the end of the file
+            uint32_t findFreeSectors(uint32_t count) const;
+
+            // writes the location and timestamp of the chunk to the header
+            bool writeHeaderEntry(unsigned int chunkID, uint32_t location, uint32_t timestamp);
+
+            // marks the sectors as used or free
+            void markSectors(uint32_t offset, uint32_t sectors, bool used);
+
+            // decompresses the chunk data following the chunk header into data
+            Bytestream * inflateChunk(const unsigned char * compressed, uint32_t lengthCompressed, Bytestream * data, bool owned) const;
+
+            RegionFile(const RegionFile &);             // not copyable
+            RegionFile & operator=(const RegionFile &); // the descriptor is owned
+    };
+
+    class RegionCache {
+        public:
+            // keeps at most maxOpen regions of the world open
+            // if mapped is set, regions are mapped into memory (see RegionFile::open)
+            RegionCache(std::string worldpath, unsigned int maxOpen = 64, bool mapped = false);
+
+            // gets the region containing the chunk at (x,z), opened if needed
+            // NULL if the world has no such region
+            // the region stays usable while the pointer is held, even when evicted
+            std::shared_ptr<RegionFile> getRegion(long int chunkx, long int chunkz);
+
+            // reads and decompresses the chunk at (x,z) into data
+            // data is NULL if the chunk is not present or any other error occured
+            // see RegionFile::readChunk() for owned
+            Bytestream * readChunk(long int chunkx, long int chunkz, Bytestream * data, bool owned = true);
+
+            // closes all regions not in use
+            void clear();
+
+        private:
+            typedef std::pair<long int, long int> RegionPos;
+            struct RegionPosHash {
+                size_t operator()(const RegionPos & pos) const {
+                    return std::hash<long int>()(pos.first * 31 + pos.second);
+                }
+            };
+            struct Entry {
+                std::shared_ptr<RegionFile> region; // NULL if there is no such file
+                std::list<RegionPos>::iterator lruPos;
+            };
+
+            std::string worldpath;
+            unsigned int maxOpen;
+            bool mapped;
+            std::mutex lock;
+            std::list<RegionPos> lru; // most recently used first
+            std::unordered_map<RegionPos, Entry, RegionPosHash> regions;
+    };
+
+    class ChunkBatch {
+        public:
+            // collects chunks to be saved into the regions of the world at the path
+            ChunkBatch(std::string worldpath);
+
+            // adds the tag as the chunk at (x,z), timestamp 0 means the time of saving
+            // the tag is not copied and has to stay valid until save() returns
+            // adding a chunk again replaces it
+            void add(long int chunkx, long int chunkz, const Tag * tag, uint32_t timestamp = 0);
+
+            // number of chunks added since the last save()
+            size_t size() const;
+
+            // serializes and compresses the chunks in parallel, each region is
+            // written by RegionFile::writeCompressedChunks() once all its chunks are ready
+            // the batch is empty afterwards
+            // false if any chunk could not be saved
+            bool save(int level = Z_DEFAULT_COMPRESSION);
+
+        private:
+            struct Pending {
+                long int chunkx, chunkz;
+                const Tag * tag;
+                uint32_t timestamp;
+            };
+
+            std::string worldpath;
+            std::vector<Pending> pending;
+    };
+
+}
+
+#endif
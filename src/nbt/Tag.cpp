@@ -3,14 +3,15 @@
  * A class for loading and accessing NBT data
  *
  * TODO tests for NULL-pointer, range, etc.
- * TODO write tag to file and chunk
  *
  * by Gjum <gjum42@gmail.com>
  */
 
 #include "Tag.h"
+#include "Region.h"
+#include "Inflater.h"
 
-#include <stdexcept> // TODO make string to int conversion better
+#include <sys/stat.h>
 
 //#define DEBUG if (1)
 #ifndef DEBUG
@@ -19,6 +20,213 @@
 
 namespace NBT {
 
+    //========== Bytestream ==========
+
+    // reads an uncompressed or gzipped file
+    // the whole file is read at once and inflated by the thread's Inflater
+    // data is NULL on error
+    Bytestream * Bytestream::loadFromFile(std::string path) {
+        DEBUG printf("Reading file '%s' ...\n", path.c_str());
+        FILE * file = fopen(path.c_str(), "rb");
+        if (file == NULL) {
+            DEBUG printf("ERROR: Could not open file\n");
+            return loadFromByteArray(NULL, 0);
+        }
+        struct stat info;
+        if (fstat(fileno(file), &info) != 0 || info.st_size < 0) {
+            fclose(file);
+            return loadFromByteArray(NULL, 0);
+        }
+        unsigned long int fileSize = info.st_size;
+        unsigned char magic[2] = {0, 0};
+        bool gzip = fileSize >= 18 && fread(magic, 1, 2, file) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+        rewind(file);
+
+        // uncompressed, read straight into the buffer
+        if (!gzip) {
+            char * buffer = new char[fileSize > 0 ? fileSize : 1];
+            unsigned long int bytesRead = fread(buffer, 1, fileSize, file);
+            fclose(file);
+            if (bytesRead != fileSize) {
+                printf("ERROR: Could not read file '%s'\n", path.c_str());
+                delete[] buffer;
+                return loadFromByteArray(NULL, 0);
+            }
+            loadFromByteArray(buffer, fileSize);
+            DEBUG printf("File reading successful.\n");
+            return this;
+        }
+
+        Inflater & inflater = Inflater::forThread();
+        unsigned char * compressed = inflater.getInputBuffer(fileSize);
+        unsigned long int bytesRead = fread(compressed, 1, fileSize, file);
+        fclose(file);
+        if (bytesRead != fileSize) {
+            printf("ERROR: Could not read file '%s'\n", path.c_str());
+            return loadFromByteArray(NULL, 0);
+        }
+        // the inflater takes the size of the output from the gzip trailer
+        unsigned long int used = 0;
+        if (inflater.inflate(compressed, fileSize, &used) == NULL) {
+            printf("ERROR: Could not inflate file '%s'\n", path.c_str());
+            return loadFromByteArray(NULL, 0);
+        }
+        loadFromByteArray(inflater.releaseBuffer(), used);
+        DEBUG printf("File reading successful.\n");
+        return this;
+    }
+
+    // opens an uncompressed or gzipped file for incremental reading,
+    // only windowSize bytes (or the largest required run) are held at once
+    // data is NULL on error
+    Bytestream * Bytestream::openFile(std::string path, unsigned long int windowSize) {
+        if (source != NULL) gzclose(source);
+        gzFile file = gzopen(path.c_str(), "rb");
+        if (file == NULL) {
+            DEBUG printf("ERROR: Could not open file\n");
+            return loadFromByteArray(NULL, 0);
+        }
+        loadFromByteArray(new char[windowSize], 0);
+        capacity = windowSize;
+        source = file;
+        sourceEnded = false;
+        return this;
+    }
+
+    // makes count bytes at the cursor readable in one piece,
+    // refilling the window if the data comes from a source
+    // false if the data ends before
+    bool Bytestream::fill(unsigned long int count) {
+        if (cursor > length) cursor = length;
+        if (sourceEnded) return length-cursor >= count;
+        // move the unread rest to the front
+        unsigned long int rest = length-cursor;
+        memmove(data, data+cursor, rest);
+        cursor = 0;
+        length = rest;
+        for (;;) {
+            // refill the whole window
+            while (length < capacity) {
+                int bytesRead = gzread(source, data+length, capacity-length);
+                if (bytesRead < 0) printf("Error in gzread (readBytes < 0)\n");
+                if (bytesRead <= 0) {
+                    sourceEnded = true;
+                    break;
+                }
+                length += bytesRead;
+            }
+            if (length >= count || sourceEnded) break;
+            // still too small, double the window
+            // it never grows much beyond the data, even if count is a corrupt size
+            unsigned long int grown = capacity*2;
+            char * window = new char[grown];
+            memcpy(window, data, length);
+            delete[] data;
+            data = window;
+            capacity = grown;
+        }
+        return length >= count;
+    }
+
+    // NULL if the data ends before, the rest of addr is zeroed then
+    void * Bytestream::getBytes(void * addr, unsigned long int count) {
+        char * dest = (char *) addr;
+        while (count > 0) {
+            if (!require(1)) {
+                memset(dest, 0, count);
+                return NULL;
+            }
+            unsigned long int n = length-cursor < count ? length-cursor : count;
+            memcpy(dest, data+cursor, n);
+            cursor += n;
+            dest += n;
+            count -= n;
+        }
+        return addr;
+    }
+
+    // false if the data ends before
+    bool Bytestream::skip(unsigned long int count) {
+        while (count > 0) {
+            if (!require(1)) return false;
+            unsigned long int n = length-cursor < count ? length-cursor : count;
+            cursor += n;
+            count -= n;
+        }
+        return true;
+    }
+
+    // reads count big-endian values at once
+    // false if the data ends before, the rest of out is zeroed then
+    bool Bytestream::readIntArray(int32_t * out, unsigned long int count) {
+        if (count > ((unsigned long int) -1) / 4 || !require(4*count)) {
+            // decode what is there
+            unsigned long int available = remaining() / 4;
+            if (available > count) available = count;
+            swapArray32(out, data + cursor, available);
+            cursor += 4*available;
+            memset(out + available, 0, 4*(count - available));
+            return false;
+        }
+        swapArray32(out, data + cursor, count);
+        cursor += 4*count;
+        return true;
+    }
+
+    bool Bytestream::readLongArray(int64_t * out, unsigned long int count) {
+        if (count > ((unsigned long int) -1) / 8 || !require(8*count)) {
+            unsigned long int available = remaining() / 8;
+            if (available > count) available = count;
+            swapArray64(out, data + cursor, available);
+            cursor += 8*available;
+            memset(out + available, 0, 8*(count - available));
+            return false;
+        }
+        swapArray64(out, data + cursor, count);
+        cursor += 8*count;
+        return true;
+    }
+
+    // reads and decompresses the chunk at (x,z) of the world at the path
+    // data is NULL if the chunk is not present or any other error occured
+    // use a RegionCache to load many chunks
+    Bytestream * Bytestream::loadFromChunk(std::string worldpath, long int chunkx, long int chunkz) {
+        RegionFile region;
+        if (!region.open(RegionFile::getPath(worldpath, chunkx, chunkz)))
+            return loadFromByteArray(NULL, 0);
+        return region.readChunk(chunkx, chunkz, this);
+    }
+
+    //========== TagPath ==========
+
+    // splits the path at dots like getSubTag(), empty segments are skipped
+    TagPath::TagPath(const std::string & path) {
+        size_t start = 0;
+        while (start < path.length()) {
+            size_t end = path.find('.', start);
+            if (end == std::string::npos) end = path.length();
+            if (end > start) {
+                Segment segment;
+                segment.name = path.substr(start, end - start);
+                segment.hash = Tag::hashName(segment.name.data(), segment.name.length());
+                if (!Tag::parseIndex(segment.name.data(), segment.name.length(), &segment.index))
+                    segment.index = -1;
+                segments.push_back(segment);
+            }
+            start = end + 1;
+        }
+    }
+
+    // number of segments
+    size_t TagPath::size() const {
+        return segments.size();
+    }
+
+    //========== Tag ==========
+
+    // smaller compounds are searched linearly
+    static const uint32_t nameIndexMinSize = 16;
+
     Tag::Tag() {
         name = "";
         type = tagTypeInvalid;
@@ -50,16 +258,16 @@ namespace NBT {
         payloadToBeDeleted = true;
     }
 
-    Tag::Tag(std::string name_, TagType type_, TagType valueType, std::vector<Payload *> * values) {
+    Tag::Tag(std::string name_, TagType type_, TagType valueType, TagVector * items) {
         name = name_;
         type = type_;
         payload = new Payload;
         payload->tagList.type = valueType;
-        payload->tagList.values = values;
+        payload->tagList.items = items;
         payloadToBeDeleted = false;
     }
 
-    Tag::Tag(std::string name_, TagType type_, std::vector<Tag *> * tags) {
+    Tag::Tag(std::string name_, TagType type_, TagVector * tags) {
         name = name_;
         type = type_;
         payload = new Payload;
@@ -67,58 +275,97 @@ namespace NBT {
         payloadToBeDeleted = false;
     }
 
+    Tag::Tag(std::string name_, TagType type_, std::vector<int8_t> * values) {
+        name = name_;
+        type = type_;
+        payload = new Payload;
+        payload->tagByteArray = values;
+        payloadToBeDeleted = false;
+    }
+
+    Tag::Tag(std::string name_, TagType type_, std::vector<int32_t> * values) {
+        name = name_;
+        type = type_;
+        payload = new Payload;
+        payload->tagIntArray = values;
+        payloadToBeDeleted = false;
+    }
+
+    Tag::Tag(std::string name_, TagType type_, std::vector<int64_t> * values) {
+        name = name_;
+        type = type_;
+        payload = new Payload;
+        payload->tagLongArray = values;
+        payloadToBeDeleted = false;
+    }
+
     Tag::~Tag() {
         safeRemovePayload();
+        if (nameIndex != NULL && arena == NULL) delete[] nameIndex;
+        if (arena != NULL && !inArena) delete arena;
+        if (buffer != NULL) delete buffer;
     }
 
     //========== create tag ==========
 
     // reads an uncompressed or gzipped file
-    Tag * Tag::loadFromFile(std::string path) {
-        DEBUG printf("Reading file '%s' ...\n", path.c_str());
-        // read buffer from file
-        gzFile file = gzopen(path.c_str(), "rb");
-        if (file == NULL) {
-            DEBUG printf("ERROR: Could not open file\n");
+    Tag * Tag::loadFromFile(std::string path, int flags) {
+        Bytestream * data = new Bytestream;
+        if (flags & (loadView | loadLazy | loadArena)) data->loadFromFile(path); // views need the whole buffer
+        else data->openFile(path); // parse while inflating
+        if (data->data == NULL) {
+            delete data;
             return this;
         }
-        const unsigned short stepSize = 4096;
-        unsigned long int bufSize = stepSize;
-        char * buffer = new char[bufSize];
-        for (;;) { // breaks on success
-            int bytesRead = gzread(file, buffer+(bufSize-stepSize), stepSize);
-            // error while ungzipping?
-            // TODO better error handling
-            if (bytesRead < 0) {
-                printf("Error in gzread (readBytes < 0)\n");
-                return this;
-            }
-            if (bytesRead < stepSize) break; // EOF, success
-            // buffer too small, increase buffer size
-            unsigned long int oldSize = bufSize;
-            bufSize += stepSize;
-            char * oldBuffer = buffer;
-            buffer = new char[bufSize];
-            memcpy(buffer, oldBuffer, oldSize);
-            delete[] oldBuffer;
-        }
-        gzclose_w(file);
-
-        // parse data
-        loadFromBytestream(new Bytestream(buffer, bufSize));
-        delete[] buffer;
-        DEBUG printf("File reading successful.\n");
+        loadFromBytestream(data, flags);
+        if (!(flags & (loadView | loadLazy | loadArena))) delete data; // also deletes the buffer
         return this;
     }
 
     // reads from uncompressed array
-    Tag * Tag::loadFromBytestream(Bytestream * data) {
-        //DEBUG printf("readTag: data=%#x\n", data);
+    // with loadView the tag takes ownership of data and deletes it when destroyed
+    Tag * Tag::loadFromBytestream(Bytestream * data, int flags) {
+        if (inArena) {
+            // the tag lives in the arena of its tree, which cannot free its old payload
+            printf("ERROR: cannot load into a tag inside a tree loaded with loadArena\n");
+            return this;
+        }
+        // the name index of the parent does not know the new name
+        if (parent != NULL) parent->nameIndexSize = 0;
         safeRemovePayload();
+        payload = NULL;
+        if (nameIndex != NULL && arena == NULL) delete[] nameIndex;
+        nameIndex = NULL;
+        nameIndexSize = 0;
+        if (arena != NULL && !(flags & loadArena)) {
+            delete arena;
+            arena = NULL;
+        }
+        if (buffer != NULL) delete buffer;
+        buffer = NULL;
+        lazyData = NULL;
+        if (flags & (loadLazy | loadArena)) flags |= loadView;
+        // the tree takes roughly as much memory as its data, large trees get more blocks
+        // loading again frees the old tree at once and reuses the arena's largest block
+        if ((flags & loadArena) && arena != NULL) arena->reset();
+        else if (flags & loadArena) arena = new Arena(data->length < (1 << 20) ? data->length : (1 << 20));
+        readTag(data, flags);
+        if (flags & loadView) buffer = data;
+        return this;
+    }
+
+    // reads type, name, and payload from the Bytestream
+    // if defer is set, the payload is only located (see loadLazy)
+    Tag * Tag::readTag(Bytestream * data, int flags, bool defer) {
+        //DEBUG printf("readTag: data=%#x\n", data);
+        bool view = flags & loadView;
         name = "";
+        nameView = NULL;
+        nameViewLength = 0;
+        isView = view;
         type = static_cast<TagType>(data->get());
         DEBUG printf("type=%i\n", type);
-        if (type < 0 || type > 11) {
+        if (type < 0 || type > tagTypeLongArray) {
             printf("ERROR: invalid type %i %#x\n", (int) type, (int) type);
             return this;
         }
@@ -127,12 +374,35 @@ namespace NBT {
             int16_t nameSize = 0;
             data->getInverseEndian(&nameSize, 2);
             DEBUG printf("nameSize=%i\n", nameSize);
-            // name = ""; was done before
-            for (int i = 0; i < nameSize; i++)
-                name += data->get();
-            DEBUG printf("name=%s\n", name.c_str());
+            if (nameSize < 0 || (unsigned long int) nameSize > data->remaining()) {
+                printf("ERROR: invalid name size %i\n", nameSize);
+                type = tagTypeInvalid;
+                return this;
+            }
+            if (view) {
+                nameView = data->data + data->cursor;
+                nameViewLength = nameSize;
+                data->cursor += nameSize;
+            }
+            else {
+                name.resize(nameSize);
+                if (nameSize > 0) data->getBytes(&name[0], nameSize);
+            }
+            DEBUG printf("name=%s\n", getName().c_str());
+            // locate payload, parsed later by parseLazy()
+            if (defer) {
+                unsigned long int start = data->cursor;
+                if (!skipPayload(type, data)) {
+                    printf("ERROR: invalid payload of '%s'\n", getName().c_str());
+                    type = tagTypeInvalid;
+                    return this;
+                }
+                lazyData = data->data + start;
+                lazyLength = data->cursor - start;
+                return this;
+            }
             // read payload
-            payload = readPayload(type, data);
+            payload = readPayload(type, data, flags);
             // TODO test if payload could be read
             payloadToBeDeleted = true;
         }
@@ -140,138 +410,116 @@ namespace NBT {
     }
 
     // loads the chunk at (x,z) of the world at the path
-    // returns 0 if chunk is empty or any other error occured
-    // TODO check if chunk is populated or empty
-    Tag * Tag::loadFromChunk(std::string worldpath, long int chunkx, long int chunkz) {
-        // open file
-        int regx = chunkx >> 5;
-        int regz = chunkz >> 5;
-        long int chunkxPositive = chunkx;
-        long int chunkzPositive = chunkz;
-        while (chunkxPositive < 0) chunkxPositive += 32;
-        while (chunkzPositive < 0) chunkzPositive += 32;
-        unsigned int chunkID = (chunkxPositive % 32) + (chunkzPositive % 32) * 32;
-        DEBUG printf("chunk %i %i\nregion %i %i\nid %i",
-                chunkx, chunkz, regx, regz, chunkID);
-        std::string filePath = worldpath + "/region/r." + std::to_string(regx) + "." + std::to_string(regz) + ".mca";
-        std::ifstream file(filePath, std::ifstream::in | std::ifstream::binary);
-
-        // TODO test if file is open
-
-        // read file header
-        int32_t chunkPos = 0;
-        file.seekg(chunkID*4);
-        file.read((char*)(&chunkPos), 4);
-        DEBUG printf("chunkPos before: %i %1$8x\n", chunkPos);
-        Tag::swapBytes((unsigned char*) &chunkPos, 4);
-        chunkPos = chunkPos >> 8;
-        DEBUG printf("chunkPos=%i %1$8x\n", chunkPos);
-
-        if (chunkPos == 0) return this;
-
-        // TODO read chunk date?
-
-        // read chunk header
-        int32_t lengthCompressed = 0;
-        file.seekg(chunkPos*4096);
-        file.read((char*)(&lengthCompressed), 4);
-        Tag::swapBytes((unsigned char*) &lengthCompressed, 4);
-
-        if (lengthCompressed == 0) return this;
-
-        // TODO check compression type
-
-        // read compressed chunk data
-        unsigned char bufferCompressed[int(lengthCompressed*1.1)];
-        file.seekg(chunkPos*4096+5);
-        file.read((char*) bufferCompressed, lengthCompressed);
-        file.close();
-
-        // print bufferCompressed
-        DEBUG {
-            printf("lengthCompressed=%i\n", lengthCompressed);
-            for (int i = 0; i < lengthCompressed && i < 512; i++) {
-                printf("%2x ", (unsigned char) bufferCompressed[i]);
-                if (i%8 == 7) printf(" ");
-                if (i%32 == 31) printf("\n");
-            }
-        }
-
-        // uncompress buffer
-        unsigned int step = 4096;
-        long unsigned int lengthUncompressed = 65536;
-        unsigned char *bufferUncompressed = new unsigned char[lengthUncompressed];
-        for (;;) { // breaks on success
-            int result = uncompress(
-                    bufferUncompressed,
-                    &lengthUncompressed,
-                    bufferCompressed,
-                    lengthCompressed);
-            // error while unzipping?
-            // TODO better error handling
-            if (result == Z_MEM_ERROR) {
-                //printf("Error in region file! Z_MEM_ERROR at chunk %i %i\n", chunkx, chunkz);
-                delete[] bufferUncompressed;
-                return this;
-            }
-            else if (result == Z_DATA_ERROR) {
-                //printf("Error in region file! Z_DATA_ERROR at chunk %i %i\n", chunkx, chunkz);
-                delete[] bufferUncompressed;
-                return this;
-            }
-            else if (result != Z_BUF_ERROR) break; // success
-            // buffer too small, increase buffer size
-            lengthUncompressed += step;
-            delete[] bufferUncompressed;
-            bufferUncompressed = new unsigned char[lengthUncompressed];
-        }
-
-        // print bufferUncompressed
-        DEBUG {
-            printf("lengthUncompressed=%i\n", lengthUncompressed);
-            for (long unsigned int i = 0; i < lengthUncompressed && i < 512; i++) {
-                printf("%2x ", bufferUncompressed[i]);
-                if (i%8 == 7) printf(" ");
-                if (i%32 == 31) printf("\n");
-            }
+    // the tag stays unchanged if the chunk is not present or any other error occured
+    Tag * Tag::loadFromChunk(std::string worldpath, long int chunkx, long int chunkz, int flags) {
+        Bytestream * data = (new Bytestream)->loadFromChunk(worldpath, chunkx, chunkz);
+        if (data->data == NULL) {
+            delete data;
+            return this;
         }
+        loadFromBytestream(data, flags);
+        // a view keeps the buffer until the tag is deleted
+        if (!(flags & (loadView | loadLazy | loadArena))) delete data; // also deletes the buffer
+        return this;
+    }
 
-        // create chunk from buffer
-        Bytestream * data = (new Bytestream)->loadFromByteArray((char *) bufferUncompressed, lengthUncompressed);
-        loadFromBytestream(data);
+    // loads the chunk at (x,z) from the regions of the cache
+    Tag * Tag::loadFromChunk(RegionCache * regions, long int chunkx, long int chunkz, int flags) {
+        std::shared_ptr<RegionFile> region = regions->getRegion(chunkx, chunkz);
+        if (!region) return this;
+        return loadFromChunk(region.get(), chunkx, chunkz, flags);
+    }
 
-        // cleanup
-        delete data;
-        //delete[] bufferUncompressed;
+    // loads the chunk at (x,z) from the opened region
+    Tag * Tag::loadFromChunk(const RegionFile * region, long int chunkx, long int chunkz, int flags) {
+        bool view = flags & (loadView | loadLazy | loadArena);
+        if (!view) {
+            // parse from the reused buffer of this thread's Inflater
+            Bytestream data;
+            if (region->readChunk(chunkx, chunkz, &data, false)->data != NULL)
+                loadFromBytestream(&data, flags);
+            return this;
+        }
+        // a view keeps the buffer until the tag is deleted
+        Bytestream * data = new Bytestream;
+        if (region->readChunk(chunkx, chunkz, data)->data == NULL) {
+            delete data;
+            return this;
+        }
+        loadFromBytestream(data, flags);
         return this;
     }
 
     //========== write tag ==========
 
     // writes to an uncompressed file
-    bool writeToFileUncompressed(std::string path) {
-        return false;
+    // false on error
+    bool Tag::writeToFileUncompressed(std::string path) const {
+        Bytestream * data = writeToBytestream();
+        if (data == NULL) return false;
+        FILE * file = fopen(path.c_str(), "wb");
+        if (file == NULL) {
+            printf("ERROR: Could not open file '%s' for writing\n", path.c_str());
+            delete data;
+            return false;
+        }
+        bool success = fwrite(data->data, 1, data->length, file) == data->length;
+        if (fclose(file) != 0) success = false;
+        if (!success) printf("ERROR: Could not write file '%s'\n", path.c_str());
+        delete data;
+        return success;
     }
 
     // writes to a gzipped file
-    bool writeToFileCompressed(std::string path) {
-        return false;
+    // false on error
+    bool Tag::writeToFileCompressed(std::string path) const {
+        Bytestream * data = writeToBytestream();
+        if (data == NULL) return false;
+        gzFile file = gzopen(path.c_str(), "wb");
+        if (file == NULL) {
+            printf("ERROR: Could not open file '%s' for writing\n", path.c_str());
+            delete data;
+            return false;
+        }
+        bool success = gzwrite(file, data->data, data->length) == (int) data->length;
+        if (gzclose(file) != Z_OK) success = false;
+        if (!success) printf("ERROR: Could not write file '%s'\n", path.c_str());
+        delete data;
+        return success;
     }
 
-    // writes to a Bytestream
-    Bytestream * writeToBytestream() {
-        return NULL;
+    // writes to a new Bytestream, which has to be deleted by the caller
+    // the exact size is computed first, so the data is written into one allocation
+    // NULL if the tag is invalid
+    Bytestream * Tag::writeToBytestream() const {
+        if (type <= tagTypeEnd || type > tagTypeLongArray) {
+            printf("ERROR: Cannot write tag of type %i\n", (int) type);
+            return NULL;
+        }
+        unsigned long int size = getWrittenSize();
+        char * buffer = new char[size];
+        writeTag(buffer);
+        return new Bytestream(buffer, size);
     }
 
     // writes the chunk at (x,z) of the world at the path
-    bool writeToChunk(std::string path, long int chunkx, long int chunkz) {
-        return false;
+    // the region file is created if needed, the chunk timestamp is set to now
+    // false on error
+    bool Tag::writeToChunk(std::string worldpath, long int chunkx, long int chunkz) const {
+        Bytestream * data = writeToBytestream();
+        if (data == NULL) return false;
+        RegionFile region;
+        bool success = region.openForWriting(RegionFile::getPath(worldpath, chunkx, chunkz))
+            && region.writeChunk(chunkx, chunkz, data->data, data->length);
+        delete data;
+        return success;
     }
 
     //========== get information ==========
 
     // get tag name
     std::string Tag::getName() const {
+        if (nameView != NULL) return std::string(nameView, nameViewLength);
         return name;
     }
 
@@ -285,7 +533,7 @@ namespace NBT {
     // get tag as string (type, name, and value)
     // prints compounds and lists as json-style tree
     std::string Tag::toString() const {
-        return tagTypeToString(type) + "('" + name + "'): " + asString();
+        return tagTypeToString(type) + "('" + getName() + "'): " + asString();
     }
 
     // get value if numeric
@@ -322,6 +570,7 @@ namespace NBT {
     std::string Tag::asString() const {
         if (isIntType(type)) return std::to_string(payload->tagInt);
         else if (isFloatType(type)) return std::to_string(payload->tagFloat);
+        else if (type == tagTypeString && isView) return std::string(payload->tagView.data, payload->tagView.length);
         else if (type == tagTypeString) return *payload->tagString;
         else if (isListType(type) || type == tagTypeCompound) {
             std::string str = std::to_string(getListSize()) + " entries\n{\n";
@@ -331,6 +580,10 @@ namespace NBT {
                     str += "  ... and " + std::to_string(getListSize()-10) + " more\n";
                     break;
                 }
+                if (isArrayType(type)) { // values without tags
+                    str += "  " + tagTypeToString(getListType()) + "('" + std::to_string(i) + "'): " + getListItemAsString(i) + "\n";
+                    continue;
+                }
                 Tag * tag = getListItemAsTag(i);
                 if (tag != NULL) {
                     std::string content = "  " + tag->toString();
@@ -353,43 +606,51 @@ namespace NBT {
     // format: "list.42.intHolder..myInt."
     // (multiple dots are like one dot, dots at the end are ignored)
     Tag * Tag::getSubTag(std::string path) {
-        size_t dotPos = path.find_first_of('.');
-        std::string first = path.substr(0, dotPos);
-        std::string rest  = "";
-        if (dotPos < path.length()) rest = path.substr(dotPos+1);
-        DEBUG printf("getSubTag: path='%s', first='%s', rest='%s' at tag '%s'\n", path.c_str(), first.c_str(), rest.c_str(), name.c_str());
-        if (path.length() <= 0) return this; // recursion anchor
-        if (first.length() <= 0) return getSubTag(rest); // allows "foo..bar." == "foo.bar"
-        Tag * tag = NULL;
-        if (isListType(type) || type == tagTypeCompound) {
-            for (int32_t i = 0; i < getListSize(); i++) {
-                tag = getListItemAsTag(i);
-                if (tag == NULL) continue; // didn't get a tag ... why?
-                if (first.compare(tag->getName()) == 0)
-                    break;
-                else tag = NULL; // do not remember incorrect tags
+        DEBUG printf("getSubTag: path='%s' at tag '%s'\n", path.c_str(), getName().c_str());
+        Tag * tag = this;
+        size_t start = 0;
+        while (tag != NULL && start < path.length()) {
+            size_t end = path.find('.', start);
+            if (end == std::string::npos) end = path.length();
+            if (end > start) { // allows "foo..bar." == "foo.bar"
+                const char * segment = path.data() + start;
+                int32_t index = -1;
+                if (!parseIndex(segment, end - start, &index)) index = -1;
+                tag = tag->getChild(segment, end - start, hashName(segment, end - start), index);
             }
+            start = end + 1;
         }
-        // we still found no matching tag, try interpreting first as number and getting n-th tag
-        if (tag == NULL) {
-            try {
-                tag = getListItemAsTag(stoi(first));
-                DEBUG printf("getting tag #%i\n", stoi(first));
-            }
-            catch (const std::invalid_argument& ia) {
-                tag = NULL;
-            }
+        return tag;
+    }
+
+    // gets the child at the compiled path, like getSubTag(std::string)
+    // does not allocate if the path only leads through compounds
+    Tag * Tag::getSubTag(const TagPath & path) {
+        Tag * tag = this;
+        for (size_t i = 0; tag != NULL && i < path.segments.size(); i++) {
+            const TagPath::Segment & segment = path.segments[i];
+            tag = tag->getChild(segment.name.data(), segment.name.length(), segment.hash, segment.index);
         }
-        // still no luck? we're out of ideas, return nothing
-        if (tag == NULL) return NULL;
-        return tag->getSubTag(rest);
+        return tag;
     }
 
     // get the size of the list or compound
     // 0 if no list or compound
     int32_t Tag::getListSize() const {
+        if (isArrayType(type) && isView) {
+            return payload->tagView.length;
+        }
+        if (type == tagTypeByteArray) {
+            return payload->tagByteArray->size();
+        }
+        if (type == tagTypeIntArray) {
+            return payload->tagIntArray->size();
+        }
+        if (type == tagTypeLongArray) {
+            return payload->tagLongArray->size();
+        }
         if (isListType(type)) {
-            return payload->tagList.values->size();
+            return payload->tagList.items->size();
         }
         if (type == tagTypeCompound) {
             return payload->tagCompound->size();
@@ -397,62 +658,135 @@ namespace NBT {
         return 0;
     }
 
+    // get the type of the list
+    // tagTypeInvalid if no list
+    TagType Tag::getListType() const {
+        if (type == tagTypeByteArray) return tagTypeByte;
+        if (type == tagTypeIntArray)  return tagTypeInt;
+        if (type == tagTypeLongArray) return tagTypeLong;
+        if (type == tagTypeList)      return payload->tagList.type;
+        return tagTypeInvalid;
+    }
+
     // gets the ith item of a number list
     // 0 if no such type or out of bounds
     // may be rounded if list of floating point numbers
     int64_t Tag::getListItemAsInt(int32_t i) const {
-        if (isIntType(payload->tagList.type))
-            return payload->tagList.values->at(i)->tagInt;
-        if (isFloatType(payload->tagList.type))
-            return payload->tagList.values->at(i)->tagFloat;
-        return 0;
+        if (isArrayType(type)) {
+            if (i < 0 || i >= getListSize()) return 0;
+            if (isView) {
+                if (type == tagTypeByteArray) return (int8_t) payload->tagView.data[i];
+                if (type == tagTypeIntArray) return loadBigEndian32(payload->tagView.data + 4*i);
+                return loadBigEndian64(payload->tagView.data + 8*i);
+            }
+            if (type == tagTypeByteArray) return (*payload->tagByteArray)[i];
+            if (type == tagTypeIntArray) return (*payload->tagIntArray)[i];
+            return (*payload->tagLongArray)[i];
+        }
+        if (type != tagTypeList || i < 0 || i >= getListSize()) return 0;
+        return payload->tagList.items->at(i)->asInt();
     }
 
     // gets the ith item of a number list
     // 0.0 if no such type or out of bounds
     double Tag::getListItemAsFloat(int32_t i) const {
-        if (isIntType(payload->tagList.type))
-            return payload->tagList.values->at(i)->tagInt;
-        if (isFloatType(payload->tagList.type))
-            return payload->tagList.values->at(i)->tagFloat;
-        return 0.0;
+        if (isArrayType(type)) return getListItemAsInt(i);
+        if (type != tagTypeList || i < 0 || i >= getListSize()) return 0.0;
+        return payload->tagList.items->at(i)->asFloat();
     }
 
     // gets the ith item of a list as string
     // "" if out of bounds
     // may contain '\n' if list or compound
     std::string Tag::getListItemAsString(int32_t i) const {
-        if (isIntType(payload->tagList.type))
-            return std::to_string(payload->tagList.values->at(i)->tagInt);
-        if (isFloatType(payload->tagList.type))
-            return std::to_string(payload->tagList.values->at(i)->tagFloat);
-        if (payload->tagList.type == tagTypeString)
-            return *payload->tagList.values->at(i)->tagString;
-        // no primitive type, use Tag::asString()
-        Tag * tag = getListItemAsTag(i);
-        if (tag) {
-            std::string str = tag->asString();
-            delete tag;
-            return str;
+        if (isArrayType(type)) {
+            if (i < 0 || i >= getListSize()) return "";
+            return std::to_string(getListItemAsInt(i));
         }
-        return "";
+        Tag * tag = getListItemAsTag(i);
+        if (tag == NULL) return "";
+        return tag->asString();
     }
 
     // gets the ith item of a list or compound
-    // NULL if out of bounds or no list or compound
+    // the item belongs to this tag, do not delete it
+    // NULL if out of bounds or no list or compound (arrays have no item tags)
     Tag * Tag::getListItemAsTag(int32_t i) const {
         if (i < 0 || i >= getListSize()) return NULL;
-        if (isListType(type)) {
-            return createTagFromPayload(std::to_string(i),
-                    payload->tagList.type,
-                    payload->tagList.values->at(i));
+        if (type == tagTypeList) {
+            return payload->tagList.items->at(i);
         }
         if (type == tagTypeCompound) {
-            return payload->tagCompound->at(i);
+            Tag * tag = payload->tagCompound->at(i);
+            tag->parseLazy();
+            return tag;
         }
         return NULL;
     }
 
+    // gets the contiguous values of a byte, int, or long array
+    // NULL if no such type
+    const int8_t * Tag::getByteArrayData() const {
+        if (type != tagTypeByteArray) return NULL;
+        if (isView) return (const int8_t *) payload->tagView.data;
+        return payload->tagByteArray->data();
+    }
+
+    const int32_t * Tag::getIntArrayData() const {
+        if (type != tagTypeIntArray || isView) return NULL;
+        return payload->tagIntArray->data();
+    }
+
+    const int64_t * Tag::getLongArrayData() const {
+        if (type != tagTypeLongArray || isView) return NULL;
+        return payload->tagLongArray->data();
+    }
+
+    // same as above, T is the value type: getArrayData<int32_t>()
+    // NULL if the tag is no array of T
+    template <> const int8_t * Tag::getArrayData<int8_t>() const {
+        return getByteArrayData();
+    }
+
+    template <> const int32_t * Tag::getArrayData<int32_t>() const {
+        return getIntArrayData();
+    }
+
+    template <> const int64_t * Tag::getArrayData<int64_t>() const {
+        return getLongArrayData();
+    }
+
+    // decodes all values of an array of T into out, in any load mode
+    // out needs getListSize() values, false if the tag is no array of T
+    template <> bool Tag::copyArrayData<int8_t>(int8_t * out) const {
+        const int8_t * values = getByteArrayData();
+        if (values == NULL) return false;
+        memcpy(out, values, getListSize());
+        return true;
+    }
+
+    template <> bool Tag::copyArrayData<int32_t>(int32_t * out) const {
+        if (type != tagTypeIntArray) return false;
+        if (isView) swapArray32(out, payload->tagView.data, payload->tagView.length);
+        else memcpy(out, payload->tagIntArray->data(), 4 * payload->tagIntArray->size());
+        return true;
+    }
+
+    template <> bool Tag::copyArrayData<int64_t>(int64_t * out) const {
+        if (type != tagTypeLongArray) return false;
+        if (isView) swapArray64(out, payload->tagView.data, payload->tagView.length);
+        else memcpy(out, payload->tagLongArray->data(), 8 * payload->tagLongArray->size());
+        return true;
+    }
+
+    // expands the values of bits bits packed into a long array, see BitArray.h
+    // out needs count values, false if no long array or too short
+    bool Tag::unpackLongArray(unsigned int bits, BitLayout layout, uint16_t * out, size_t count) const {
+        if (type != tagTypeLongArray) return false;
+        if (isView) return unpackBitsBigEndian(payload->tagView.data, payload->tagView.length, bits, layout, out, count);
+        return unpackBits(payload->tagLongArray->data(), payload->tagLongArray->size(), bits, layout, out, count);
+    }
+
     //========== useful functions ==========
 
     // converts a TagType into a human-readable string
@@ -469,10 +803,11 @@ namespace NBT {
             "TAG_String",
             "TAG_List",
             "TAG_Compound",
-            "TAG_IntArray"
+            "TAG_IntArray",
+            "TAG_LongArray"
         };
         char tagID = static_cast<char>(type);
-        if (tagID < 0 || tagID > 11) return "TAG_Invalid";
+        if (tagID < 0 || tagID > tagTypeLongArray) return "TAG_Invalid";
         return strings[tagID];
     }
 
@@ -487,12 +822,75 @@ namespace NBT {
         }
     }
 
+    // moves the cursor behind the payload without reading it
+    // false if the payload is invalid or exceeds the Bytestream
+    bool Tag::skipPayload(TagType type, Bytestream * data) {
+        unsigned long int size = fixedPayloadSize(type);
+        switch (type) {
+            case tagTypeByte:
+            case tagTypeShort:
+            case tagTypeInt:
+            case tagTypeLong:
+            case tagTypeFloat:
+            case tagTypeDouble:
+                break;
+            case tagTypeString: {
+                uint16_t strLen = 0;
+                if (!data->require(2)) return false;
+                data->getInverseEndian(&strLen, 2);
+                size = strLen;
+                break;
+            }
+            case tagTypeByteArray:
+            case tagTypeIntArray:
+            case tagTypeLongArray: {
+                int32_t count = 0;
+                if (!data->require(4)) return false;
+                data->getInverseEndian(&count, 4);
+                if (count < 0) return false;
+                size = (unsigned long int) count * arrayValueSize(type);
+                break;
+            }
+            case tagTypeList: {
+                if (!data->require(5)) return false;
+                TagType listType = static_cast<TagType>(data->get());
+                int32_t count = 0;
+                data->getInverseEndian(&count, 4);
+                if (count < 0 || listType < 0 || listType > tagTypeLongArray) return false;
+                if (count == 0) return true;
+                if (fixedPayloadSize(listType) > 0) {
+                    // fixed size values, skip all at once
+                    size = (unsigned long int) count * fixedPayloadSize(listType);
+                    break;
+                }
+                for (int32_t i = 0; i < count; i++)
+                    if (!skipPayload(listType, data)) return false;
+                return true;
+            }
+            case tagTypeCompound:
+                for (;;) { // breaks on TAG_End or error
+                    if (!data->require(1)) return false;
+                    TagType subType = static_cast<TagType>(data->get());
+                    if (subType == tagTypeEnd) return true;
+                    if (!data->require(2)) return false;
+                    uint16_t nameSize = 0;
+                    data->getInverseEndian(&nameSize, 2);
+                    if (nameSize > data->remaining()) return false;
+                    if (!data->skip(nameSize)) return false;
+                    if (!skipPayload(subType, data)) return false;
+                }
+            default:
+                return false;
+        }
+        return data->skip(size);
+    }
+
     // ========== private functions ========== 
 
     // returns true if type is
     // isIntType:   tagTypeByte, tagTypeShort, tagTypeInt, or tagTypeLong
     // isFloatType: tagTypeFloat or tagTypeDouble
-    // isListType:  tagTypeByteArray, tagTypeIntArray, or tagTypeList
+    // isListType:  tagTypeByteArray, tagTypeIntArray, tagTypeLongArray, or tagTypeList
     bool Tag::isIntType(TagType type) {
         return (type == tagTypeByte
                 || type == tagTypeShort
@@ -508,12 +906,43 @@ namespace NBT {
     bool Tag::isListType(TagType type) {
         return (type == tagTypeByteArray
                 || type == tagTypeIntArray
+                || type == tagTypeLongArray
                 || type == tagTypeList);
     }
 
+    bool Tag::isArrayType(TagType type) {
+        return (type == tagTypeByteArray
+                || type == tagTypeIntArray
+                || type == tagTypeLongArray);
+    }
+
+    // returns the payload size in bytes of numeric types, 0 for others
+    unsigned int Tag::fixedPayloadSize(TagType type) {
+        switch (type) {
+            case tagTypeByte:   return 1;
+            case tagTypeShort:  return 2;
+            case tagTypeInt:    return 4;
+            case tagTypeLong:   return 8;
+            case tagTypeFloat:  return 4;
+            case tagTypeDouble: return 8;
+            default:            return 0;
+        }
+    }
+
+    // returns the size in bytes of one array value, 0 if no array type
+    unsigned int Tag::arrayValueSize(TagType type) {
+        switch (type) {
+            case tagTypeByteArray: return 1;
+            case tagTypeIntArray:  return 4;
+            case tagTypeLongArray: return 8;
+            default:               return 0;
+        }
+    }
+
     // reads the payload from the Bytestream and returns it
-    Payload * Tag::readPayload(TagType type, Bytestream * data) {
-        Payload * payload = new Payload;
+    Payload * Tag::readPayload(TagType type, Bytestream * data, int flags) {
+        bool view = flags & loadView;
+        Payload * payload = arena != NULL ? arena->create<Payload>() : new Payload;
         payload->tagInt = 0;
         if (type == tagTypeByte) {
             payload->tagInt = data->get();
@@ -553,53 +982,141 @@ namespace NBT {
         }
         // string type
         else if (type == tagTypeString) {
-            int strLen = (uint16_t(data->get()) << 8) + data->get();
-            payload->tagString = new std::string("");
-            for (int i = 0; i < strLen; i++)
-                *payload->tagString += data->get();
-            DEBUG printf("tagString=%s\n", payload->tagString->c_str());
+            uint16_t strLen = 0;
+            data->getInverseEndian(&strLen, 2);
+            if (strLen > data->remaining()) {
+                printf("ERROR: invalid string size %i\n", strLen);
+                strLen = 0;
+            }
+            if (view) {
+                payload->tagView.data = data->data + data->cursor;
+                payload->tagView.length = strLen;
+            }
+            else {
+                payload->tagString = new std::string(strLen, '\0');
+                if (strLen > 0) data->getBytes(&(*payload->tagString)[0], strLen);
+            }
+            if (view) data->cursor += strLen;
+            DEBUG printf("tagString length=%i\n", strLen);
+        }
+        // arrays, stored contiguously instead of one payload per value
+        // their size is checked with require(), a stream only reads as far as it really goes
+        else if (type == tagTypeByteArray) {
+            int32_t size = 0;
+            data->getInverseEndian(&size, 4);
+            if (size < 0 || !data->require(size)) {
+                printf("ERROR: invalid byte array size %i\n", size);
+                size = 0;
+            }
+            if (view) {
+                payload->tagView.data = data->data + data->cursor;
+                payload->tagView.length = size;
+                data->cursor += size;
+                return payload;
+            }
+            payload->tagByteArray = new std::vector<int8_t>(size);
+            if (size > 0) data->getBytes(payload->tagByteArray->data(), size);
+            DEBUG printf("tagByteArray size=%i\n", size);
+        }
+        else if (type == tagTypeIntArray) {
+            int32_t size = 0;
+            data->getInverseEndian(&size, 4);
+            if (size < 0 || !data->require(4 * (unsigned long int) size)) {
+                printf("ERROR: invalid int array size %i\n", size);
+                size = 0;
+            }
+            if (view) {
+                payload->tagView.data = data->data + data->cursor;
+                payload->tagView.length = size;
+                data->cursor += 4*size;
+                return payload;
+            }
+            payload->tagIntArray = new std::vector<int32_t>(size);
+            data->readIntArray(payload->tagIntArray->data(), size);
+            DEBUG printf("tagIntArray size=%i\n", size);
+        }
+        else if (type == tagTypeLongArray) {
+            int32_t size = 0;
+            data->getInverseEndian(&size, 4);
+            if (size < 0 || !data->require(8 * (unsigned long int) size)) {
+                printf("ERROR: invalid long array size %i\n", size);
+                size = 0;
+            }
+            if (view) {
+                payload->tagView.data = data->data + data->cursor;
+                payload->tagView.length = size;
+                data->cursor += 8*size;
+                return payload;
+            }
+            payload->tagLongArray = new std::vector<int64_t>(size);
+            data->readLongArray(payload->tagLongArray->data(), size);
+            DEBUG printf("tagLongArray size=%i\n", size);
         }
         // tag holding types
-        else if (isListType(type)) {
+        else if (type == tagTypeList) {
             DEBUG printf("tagTypeList...\n");
-            TagType listType = tagTypeInvalid;
-            if (type == tagTypeByteArray)     listType = tagTypeByte;
-            else if (type == tagTypeIntArray) listType = tagTypeInt;
-            else if (type == tagTypeList) {
-                // read type
-                listType = static_cast<TagType>(data->get());
-                DEBUG printf("listType=%i\n", listType);
-            }
+            // read type
+            TagType listType = static_cast<TagType>(data->get());
+            DEBUG printf("listType=%i\n", listType);
             // read size
             int32_t size = 0;
             data->getInverseEndian(&size, 4);
-            // read values
+            // items of an unknown type cannot be read, and End items take no bytes,
+            // so a hostile count could create billions of them
+            if (listType < 0 || listType > tagTypeLongArray) {
+                printf("ERROR: unknown list type %i %#x\n", (int) listType, (int) listType);
+                listType = tagTypeEnd;
+                size = 0;
+            }
+            else if (listType == tagTypeEnd && size > 0) {
+                printf("ERROR: list of %i End tags\n", size);
+                size = 0;
+            }
+            // read values into item tags named by their index
             payload->tagList.type = listType;
-            payload->tagList.values = new std::vector<Payload *>;
+            payload->tagList.items = arena != NULL ? arena->create<TagVector>(arena) : new TagVector;
+            // each item takes at least a byte, but a stream may not have read that far yet,
+            // so only reserve what the buffered data can hold
+            unsigned long int buffered = data->cursor < data->length ? data->length - data->cursor : 0;
+            if (size > 0) payload->tagList.items->reserve((unsigned long int) size < buffered ? size : buffered);
             DEBUG printf("type=%i, size=%i\n", listType, size);
-            for (int32_t i = 0; i < size; i++)
-                payload->tagList.values->push_back(readPayload(listType, data));
+            for (int32_t i = 0; i < size; i++) {
+                if (!data->require(1)) {
+                    printf("ERROR: list ends after %i of %i items\n", i, size);
+                    break;
+                }
+                Tag * item = createChild();
+                item->type = listType;
+                item->name = std::to_string(i);
+                item->isView = view;
+                item->payload = item->readPayload(listType, data, flags);
+                item->payloadToBeDeleted = true;
+                payload->tagList.items->push_back(item);
+            }
             DEBUG printf("tagTypeList end\n");
         }
         else if (type == tagTypeCompound) {
             DEBUG printf("tagCompound...\n");
             TagType tagType;
-            payload->tagCompound = new std::vector<Tag*>;
+            payload->tagCompound = arena != NULL ? arena->create<TagVector>(arena) : new TagVector;
             while (1) { // breaks on TAG_End or error
-                Tag *subTag = (new Tag)->loadFromBytestream(data);
+                Tag *subTag = createChild();
+                subTag->readTag(data, flags, flags & loadLazy);
                 tagType = subTag->getType();
                 if (tagType == tagTypeEnd) {
-                    delete subTag;
+                    if (!subTag->inArena) delete subTag;
                     break;
                 }
-                if (tagType < 0 || tagType > 11) {
+                if (tagType < 0 || tagType > tagTypeLongArray) {
                     printf("ERROR: unknown type %i %#x\n",
                             (int) tagType, (int) tagType);
-                    delete subTag;
+                    if (!subTag->inArena) delete subTag;
                     break;
                 }
                 payload->tagCompound->push_back(subTag);
             }
+            // built now, so lookups in a loaded tree only read
+            if (payload->tagCompound->size() >= nameIndexMinSize) buildNameIndex(*payload->tagCompound);
             DEBUG printf("tagCompound end\n");
         }
         else {
@@ -608,30 +1125,264 @@ namespace NBT {
         return payload;
     }
 
-    // creates a tag from the supplied payload
-    // returns NULL if invalid type or payload
-    Tag * Tag::createTagFromPayload(std::string name, TagType type, Payload * payload) {
-        if (payload == NULL) return NULL;
-        if (type == tagTypeByte
-                || type == tagTypeShort
-                || type == tagTypeInt
-                || type == tagTypeLong) {
-            return new Tag(name, type, payload->tagInt);
+    // parses the payload located by a lazy load, if not done yet
+    void Tag::parseLazy() {
+        if (lazyData == NULL) return;
+        Bytestream data((char *) lazyData, lazyLength);
+        data.ownsData = false;
+        payload = readPayload(type, &data, loadView | loadLazy);
+        payloadToBeDeleted = true;
+        lazyData = NULL;
+    }
+
+    // true if the name equals str, without copying a viewed name
+    bool Tag::nameEquals(const std::string & str) const {
+        return nameEquals(str.data(), str.length());
+    }
+    bool Tag::nameEquals(const char * str, size_t length) const {
+        if (nameView == NULL) return name.length() == length && memcmp(str, name.data(), length) == 0;
+        return length == nameViewLength
+            && memcmp(str, nameView, nameViewLength) == 0;
+    }
+
+    // gets the compound child with the name, else the item at index (if not -1)
+    // NULL if there is none
+    Tag * Tag::getChild(const char * childName, size_t length, uint32_t hash, int32_t index) {
+        if (type == tagTypeCompound) {
+            // compare names first, so lazy siblings stay unparsed
+            int32_t i = findChild(childName, length, hash);
+            if (i >= 0) return getListItemAsTag(i);
         }
-        else if (type == tagTypeFloat
-                || type == tagTypeDouble) {
-            return new Tag(name, type, payload->tagFloat);
+        // no matching name, try the segment as index (list items are named by it)
+        if (index >= 0) {
+            DEBUG printf("getting tag #%i\n", index);
+            return getListItemAsTag(index);
         }
-        else if (type == tagTypeString) {
-            return new Tag(name, type, *payload->tagString);
+        return NULL;
+    }
+
+    // index of the compound child with the name, -1 if none
+    // hash is hashName() of the name
+    // compounds of nameIndexMinSize or more children are indexed when loaded
+    int32_t Tag::findChild(const char * childName, size_t length, uint32_t hash) {
+        if (type != tagTypeCompound) return -1;
+        const TagVector & children = *payload->tagCompound;
+        // the vector of a compound made by the caller may change at any time, it is never indexed
+        if (children.size() < nameIndexMinSize || !payloadToBeDeleted) {
+            for (size_t i = 0; i < children.size(); i++)
+                if (children[i]->nameEquals(childName, length)) return i;
+            return -1;
         }
-        else if (isListType(type)) {
-            return new Tag(name, type, payload->tagList.type, payload->tagList.values);
+        // rebuild if the children changed in size or one of them was reloaded
+        if (nameIndex == NULL || nameIndexSize != children.size()) buildNameIndex(children);
+        for (uint32_t slot = hash & nameIndexMask; nameIndex[slot] >= 0; slot = (slot + 1) & nameIndexMask) {
+            if (children[nameIndex[slot]]->nameEquals(childName, length)) return nameIndex[slot];
         }
-        else if (type == tagTypeCompound) {
-            return new Tag(name, type, payload->tagCompound);
+        return -1;
+    }
+
+    // fills nameIndex with the positions of the compound children
+    void Tag::buildNameIndex(const TagVector & children) {
+        // at most half full, so probe sequences stay short
+        uint32_t slots = 1;
+        while (slots < 2 * children.size()) slots *= 2;
+        if (nameIndex != NULL && nameIndexMask + 1 < slots && arena == NULL) delete[] nameIndex;
+        if (nameIndex == NULL || nameIndexMask + 1 < slots) {
+            nameIndex = arena != NULL ? (int32_t *) arena->allocate(slots * sizeof(int32_t), alignof(int32_t))
+                                      : new int32_t[slots];
+            nameIndexMask = slots - 1;
         }
-        return NULL;
+        memset(nameIndex, -1, (nameIndexMask + 1) * sizeof(int32_t));
+        for (size_t i = 0; i < children.size(); i++) {
+            const Tag * child = children[i];
+            size_t length = child->nameView != NULL ? child->nameViewLength : child->name.length();
+            uint32_t slot = hashName(child->nameView != NULL ? child->nameView : child->name.data(), length) & nameIndexMask;
+            // the first of equal names wins, like in a linear search
+            while (nameIndex[slot] >= 0) slot = (slot + 1) & nameIndexMask;
+            nameIndex[slot] = i;
+        }
+        nameIndexSize = children.size();
+    }
+
+    // FNV-1a hash of a name
+    uint32_t Tag::hashName(const char * str, size_t length) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < length; i++) {
+            hash ^= (unsigned char) str[i];
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    // parses a list index of decimal digits, false if it is none
+    bool Tag::parseIndex(const char * str, size_t length, int32_t * index) {
+        if (length == 0) return false;
+        int64_t value = 0;
+        for (size_t i = 0; i < length; i++) {
+            if (str[i] < '0' || str[i] > '9') return false;
+            value = value * 10 + (str[i] - '0');
+            if (value > INT32_MAX) return false;
+        }
+        *index = value;
+        return true;
+    }
+
+    // stores the lowest length bytes of value big-endian at out
+    // returns the position behind them
+    static inline char * putBigEndian(char * out, uint64_t value, unsigned int length) {
+        for (unsigned int i = 0; i < length; i++)
+            out[i] = (char) (value >> 8*(length-1-i));
+        return out + length;
+    }
+
+    // strings and names are limited to 65535 bytes by their length prefix
+    static inline uint16_t writtenStringLength(size_t length) {
+        if (length > 0xffff) {
+            printf("ERROR: string of %lu bytes too long, truncating\n", (unsigned long int) length);
+            return 0xffff;
+        }
+        return length;
+    }
+
+    // returns the size of type, name, and payload when written
+    unsigned long int Tag::getWrittenSize() const {
+        size_t nameLength = nameView != NULL ? nameViewLength : name.length();
+        unsigned long int size = 1 + 2 + (nameLength > 0xffff ? 0xffff : nameLength);
+        if (lazyData != NULL) return size + lazyLength; // written as read
+        return size + getPayloadSize(type, payload, isView);
+    }
+
+    // returns the size of the payload when written
+    unsigned long int Tag::getPayloadSize(TagType type, const Payload * payload, bool view) {
+        unsigned long int size = fixedPayloadSize(type);
+        if (size > 0) return size;
+        if (type == tagTypeString) {
+            size_t length = view ? payload->tagView.length : payload->tagString->length();
+            return 2 + (length > 0xffff ? 0xffff : length);
+        }
+        if (type == tagTypeByteArray) {
+            return 4 + (view ? payload->tagView.length : payload->tagByteArray->size());
+        }
+        if (type == tagTypeIntArray) {
+            return 4 + 4 * (unsigned long int) (view ? payload->tagView.length : payload->tagIntArray->size());
+        }
+        if (type == tagTypeLongArray) {
+            return 4 + 8 * (unsigned long int) (view ? payload->tagView.length : payload->tagLongArray->size());
+        }
+        if (type == tagTypeList) {
+            size = 1 + 4;
+            const TagVector & items = *payload->tagList.items;
+            unsigned long int valueSize = fixedPayloadSize(payload->tagList.type);
+            if (valueSize > 0) return size + valueSize * items.size();
+            for (size_t i = 0; i < items.size(); i++)
+                size += getPayloadSize(payload->tagList.type, items[i]->payload, items[i]->isView);
+            return size;
+        }
+        if (type == tagTypeCompound) {
+            size = 1; // TAG_End
+            for (size_t i = 0; i < payload->tagCompound->size(); i++)
+                size += payload->tagCompound->at(i)->getWrittenSize();
+            return size;
+        }
+        return 0;
+    }
+
+    // writes type, name, and payload to out, which has getWrittenSize() bytes
+    // returns the position behind the written tag
+    char * Tag::writeTag(char * out) const {
+        *out++ = (char) type;
+        const char * nameData = nameView != NULL ? nameView : name.data();
+        uint16_t nameLength = writtenStringLength(nameView != NULL ? nameViewLength : name.length());
+        out = putBigEndian(out, nameLength, 2);
+        memcpy(out, nameData, nameLength);
+        out += nameLength;
+        if (lazyData != NULL) {
+            // still unparsed, the payload is already serialized
+            memcpy(out, lazyData, lazyLength);
+            return out + lazyLength;
+        }
+        return writePayload(type, payload, isView, out);
+    }
+
+    // writes the payload to out, returns the position behind it
+    char * Tag::writePayload(TagType type, const Payload * payload, bool view, char * out) {
+        switch (type) {
+            case tagTypeByte:
+            case tagTypeShort:
+            case tagTypeInt:
+            case tagTypeLong:
+                return putBigEndian(out, payload->tagInt, fixedPayloadSize(type));
+            case tagTypeFloat: {
+                float value = payload->tagFloat;
+                uint32_t bits = 0;
+                memcpy(&bits, &value, 4);
+                return putBigEndian(out, bits, 4);
+            }
+            case tagTypeDouble: {
+                uint64_t bits = 0;
+                memcpy(&bits, &payload->tagFloat, 8);
+                return putBigEndian(out, bits, 8);
+            }
+            case tagTypeString: {
+                const char * str = view ? payload->tagView.data : payload->tagString->data();
+                uint16_t length = writtenStringLength(view ? payload->tagView.length : payload->tagString->length());
+                out = putBigEndian(out, length, 2);
+                memcpy(out, str, length);
+                return out + length;
+            }
+            case tagTypeByteArray: {
+                uint32_t size = view ? payload->tagView.length : payload->tagByteArray->size();
+                out = putBigEndian(out, size, 4);
+                memcpy(out, view ? (const void *) payload->tagView.data : payload->tagByteArray->data(), size);
+                return out + size;
+            }
+            case tagTypeIntArray: {
+                uint32_t size = view ? payload->tagView.length : payload->tagIntArray->size();
+                out = putBigEndian(out, size, 4);
+                if (view) {
+                    // still big-endian
+                    memcpy(out, payload->tagView.data, 4 * (unsigned long int) size);
+                    return out + 4 * (unsigned long int) size;
+                }
+                swapArray32(out, payload->tagIntArray->data(), size);
+                return out + 4 * (unsigned long int) size;
+            }
+            case tagTypeLongArray: {
+                uint32_t size = view ? payload->tagView.length : payload->tagLongArray->size();
+                out = putBigEndian(out, size, 4);
+                if (view) {
+                    memcpy(out, payload->tagView.data, 8 * (unsigned long int) size);
+                    return out + 8 * (unsigned long int) size;
+                }
+                swapArray64(out, payload->tagLongArray->data(), size);
+                return out + 8 * (unsigned long int) size;
+            }
+            case tagTypeList: {
+                const TagVector & items = *payload->tagList.items;
+                *out++ = (char) payload->tagList.type;
+                out = putBigEndian(out, items.size(), 4);
+                for (size_t i = 0; i < items.size(); i++)
+                    out = writePayload(payload->tagList.type, items[i]->payload, items[i]->isView, out);
+                return out;
+            }
+            case tagTypeCompound: {
+                for (size_t i = 0; i < payload->tagCompound->size(); i++)
+                    out = payload->tagCompound->at(i)->writeTag(out);
+                *out++ = (char) tagTypeEnd;
+                return out;
+            }
+            default:
+                return out;
+        }
+    }
+
+    // creates an empty child tag in the arena of this tag, or on the heap
+    Tag * Tag::createChild() {
+        Tag * child = arena != NULL ? arena->create<Tag>() : new Tag;
+        child->parent = this;
+        child->arena = arena;
+        child->inArena = arena != NULL;
+        return child;
     }
 
     // free compound, list, or array before deleting payload pointer
@@ -639,9 +1390,15 @@ namespace NBT {
         safeRemovePayload(payload, type);
     }
     void Tag::safeRemovePayload(Payload * payload, TagType type) {
-        DEBUG printf("Deleting payload of '%s' ...\n", name.c_str());
-        if (payload != NULL) {
-            if (type == tagTypeString && payloadToBeDeleted) {
+        DEBUG printf("Deleting payload of '%s' ...\n", getName().c_str());
+        if (arena != NULL) {
+            // freed with the arena
+        }
+        else if (payload != NULL) {
+            if (isView && (type == tagTypeString || isArrayType(type))) {
+                // points into the buffer, nothing to free
+            }
+            else if (type == tagTypeString && payloadToBeDeleted) {
                 delete payload->tagString;
             }
             else if (type == tagTypeCompound && payloadToBeDeleted) {
@@ -650,14 +1407,20 @@ namespace NBT {
                     delete payload->tagCompound->at(i);
                 delete payload->tagCompound;
             }
+            else if (type == tagTypeByteArray && payloadToBeDeleted) {
+                delete payload->tagByteArray;
+            }
+            else if (type == tagTypeIntArray && payloadToBeDeleted) {
+                delete payload->tagIntArray;
+            }
+            else if (type == tagTypeLongArray && payloadToBeDeleted) {
+                delete payload->tagLongArray;
+            }
             else if (isListType(type) && payloadToBeDeleted) {
-                DEBUG printf("Deleting list type, size=%i\n", payload->tagList.values->size());
-                for (int i = 0; i < payload->tagList.values->size(); i++) {
-                    DEBUG printf("Here goes entry %i ...\n", i);
-                    safeRemovePayload(payload->tagList.values->at(i), payload->tagList.type);
-                    //delete payload->tagList.values->at(i);
-                }
-                delete payload->tagList.values;
+                DEBUG printf("Deleting list type, size=%i\n", payload->tagList.items->size());
+                for (int i = 0; i < payload->tagList.items->size(); i++)
+                    delete payload->tagList.items->at(i);
+                delete payload->tagList.items;
             }
             else DEBUG printf("Deleting primitive type, type=%s\n", tagTypeToString(type).c_str());
             delete payload;
@@ -16,6 +16,9 @@
 #include <stdint.h>
 #include <string.h>
 #include <zlib.h>
+#include "Arena.h"
+#include "Endian.h"
+#include "BitArray.h"
 
 namespace NBT {
 
@@ -32,25 +35,59 @@ namespace NBT {
         tagTypeString    =  8,
         tagTypeList      =  9,
         tagTypeCompound  = 10,
-        tagTypeIntArray  = 11
+        tagTypeIntArray  = 11,
+        tagTypeLongArray = 12
+    };
+
+    // flags for the load functions, can be or'ed together
+    enum LoadFlags {
+        loadDefault = 0,
+        // names, strings, and arrays point into the decompressed buffer
+        // instead of being copied, the loaded tag keeps the buffer alive
+        // the tree is read-only, do not create or modify tags in it
+        loadView    = 1,
+        // compound children are only located when loading,
+        // each one is parsed when getSubTag() or getListItemAsTag() reaches it
+        // implies loadView
+        loadLazy    = 2,
+        // all tags, payloads, and lists of the tree are allocated in one Arena,
+        // freed at once when the loaded tag is deleted or loaded again (reusing the arena),
+        // the other tags of the tree cannot be loaded into
+        // implies loadView
+        loadArena   = 4
     };
 
     class Tag; // forward declaration for use in tagCompound vector
+    class RegionFile;  // see Region.h
+    class RegionCache; // see Region.h
+    // heap allocated, unless loaded with loadArena
+    typedef std::vector<Tag *, ArenaAllocator<Tag *> > TagVector;
     union Payload {
         int64_t     tagInt;
         double      tagFloat;
         std::string * tagString;
         struct {
             TagType type;
-            std::vector<Payload *> * values;
+            TagVector * items; // named by their index
         } tagList;
-        std::vector<Tag *> * tagCompound;
+        TagVector * tagCompound;
+        std::vector<int8_t>  * tagByteArray;
+        std::vector<int32_t> * tagIntArray;
+        std::vector<int64_t> * tagLongArray;
+        struct {
+            const char * data;
+            uint32_t length; // bytes for strings, values for arrays
+        } tagView; // loadView: string or big-endian array inside the buffer
     };
 
     class Bytestream {
         public:
             char * data;
             unsigned long int cursor, length;
+            bool ownsData; // if true, data is deleted with the Bytestream
+            gzFile source; // if set, data is a window refilled from this stream
+            unsigned long int capacity; // allocated size of the window
+            bool sourceEnded;
 
             Bytestream() {
                 loadFromByteArray(NULL, 0);
@@ -59,23 +96,71 @@ namespace NBT {
                 loadFromByteArray(array, length);
             }
             ~Bytestream() {
-                if (data != NULL) delete[] data;
+                if (data != NULL && ownsData) delete[] data;
+                if (source != NULL) gzclose(source);
             }
             Bytestream * loadFromByteArray(char * array, unsigned long int _length) {
                 data = array;
                 cursor = 0;
                 length = _length;
+                ownsData = true;
+                source = NULL;
+                capacity = _length;
+                sourceEnded = true;
                 return this;
             }
+
+            // reads an uncompressed or gzipped file
+            // the whole file is read at once and inflated by the thread's Inflater
+            // data is NULL on error
+            Bytestream * loadFromFile(std::string path);
+
+            // reads and decompresses the chunk at (x,z) of the world at the path
+            // data is NULL if the chunk is not present or any other error occured
+            Bytestream * loadFromChunk(std::string worldpath, long int chunkx, long int chunkz);
+
+            // opens an uncompressed or gzipped file for incremental reading,
+            // only windowSize bytes (or the largest required run) are held at once
+            // data is NULL on error
+            Bytestream * openFile(std::string path, unsigned long int windowSize = 65536);
+
+            // makes count bytes at the cursor readable in one piece,
+            // refilling the window if the data comes from a source
+            // false if the data ends before
+            bool require(unsigned long int count) {
+                return (cursor <= length && count <= length-cursor) || fill(count);
+            }
+            bool fill(unsigned long int count);
+
             char get() {
+                if (!require(1)) return 0;
                 return data[cursor++];
             }
+            // NULL if the data ends before, the rest of addr is zeroed then
+            void * getBytes(void * addr, unsigned long int count);
+            // false if the data ends before
+            bool skip(unsigned long int count);
+            // an upper bound while the source is not read to the end
+            unsigned long int remaining() const {
+                if (!sourceEnded) return (unsigned long int) -1;
+                return cursor < length ? length-cursor : 0;
+            }
             void * getInverseEndian(void * addr, unsigned int length) {
+                if (require(length)) {
+                    for (unsigned int i = 0; i < length; i++)
+                        ((char*)addr)[i] = data[cursor + length-1-i];
+                    cursor += length;
+                    return addr;
+                }
                 for (int i = length-1; i >= 0; i--) {
                     ((char*)addr)[i] = get();
                 }
                 return addr;
             }
+            // reads count big-endian values at once
+            // false if the data ends before, the rest of out is zeroed then
+            bool readIntArray(int32_t * out, unsigned long int count);
+            bool readLongArray(int64_t * out, unsigned long int count);
             static unsigned char * swapBytes(unsigned char * addr, unsigned int length) {
                 for (unsigned int i = 0; i < length/2; i++) {
                     unsigned int j = length-i-1;
@@ -87,40 +172,77 @@ namespace NBT {
             }
     };
 
+    // a path for Tag::getSubTag() split into its segments once,
+    // for running the same query against many tags
+    class TagPath {
+        public:
+            // splits the path at dots like getSubTag(), empty segments are skipped
+            explicit TagPath(const std::string & path);
+
+            // number of segments
+            size_t size() const;
+
+        private:
+            friend class Tag;
+            struct Segment {
+                std::string name;
+                uint32_t hash;  // see Tag::hashName()
+                int32_t index;  // the name as list index, -1 if it is none
+            };
+            std::vector<Segment> segments;
+    };
+
     class Tag {
+        friend class TagPath;
         public:
             Tag();
             Tag(std::string name_, TagType type_, int64_t val);
             Tag(std::string name_, TagType type_, double val);
             Tag(std::string name_, TagType type_, std::string val);
-            Tag(std::string name_, TagType type_, TagType valueType, std::vector<Payload *> * values);
-            Tag(std::string name_, TagType type_, std::vector<Tag *> * tags);
+            Tag(std::string name_, TagType type_, TagType valueType, TagVector * items);
+            Tag(std::string name_, TagType type_, TagVector * tags);
+            Tag(std::string name_, TagType type_, std::vector<int8_t> * values);
+            Tag(std::string name_, TagType type_, std::vector<int32_t> * values);
+            Tag(std::string name_, TagType type_, std::vector<int64_t> * values);
             ~Tag();
 
             //========== create tag ==========
 
             // reads an uncompressed or gzipped file
-            Tag * loadFromFile(std::string path);
+            Tag * loadFromFile(std::string path, int flags = loadDefault);
 
             // reads from uncompressed array
-            Tag * loadFromBytestream(Bytestream * data);
+            // with loadView the tag takes ownership of data and deletes it when destroyed
+            Tag * loadFromBytestream(Bytestream * data, int flags = loadDefault);
 
             // loads the chunk at (x,z) of the world at the path
-            Tag * loadFromChunk(std::string path, long int chunkx, long int chunkz);
+            Tag * loadFromChunk(std::string path, long int chunkx, long int chunkz, int flags = loadDefault);
+
+            // loads the chunk at (x,z) from the regions of the cache
+            Tag * loadFromChunk(RegionCache * regions, long int chunkx, long int chunkz, int flags = loadDefault);
+
+            // loads the chunk at (x,z) from the opened region
+            Tag * loadFromChunk(const RegionFile * region, long int chunkx, long int chunkz, int flags = loadDefault);
 
             //========== write tag ==========
 
             // writes to an uncompressed file
-            bool writeToFileUncompressed(std::string path);
+            // false on error
+            bool writeToFileUncompressed(std::string path) const;
 
             // writes to a gzipped file
-            bool writeToFileCompressed(std::string path);
+            // false on error
+            bool writeToFileCompressed(std::string path) const;
 
-            // writes to a Bytestream
-            Bytestream * writeToBytestream();
+            // writes to a new Bytestream, which has to be deleted by the caller
+            // the exact size is computed first, so the data is written into one allocation
+            // NULL if the tag is invalid
+            Bytestream * writeToBytestream() const;
 
             // writes the chunk at (x,z) of the world at the path
-            bool writeToChunk(std::string path, long int chunkx, long int chunkz);
+            // the region file is created if needed, the chunk timestamp is set to now
+            // false on error
+            bool writeToChunk(std::string worldpath, long int chunkx, long int chunkz) const;
 
             //========== get information ==========
 
@@ -154,6 +276,10 @@ namespace NBT {
             // (multiple dots are like one dot, dots at the end are ignored)
             Tag * getSubTag(std::string path);
 
+            // gets the child at the compiled path, like getSubTag(std::string)
+            // does not allocate if the path only leads through compounds
+            Tag * getSubTag(const TagPath & path);
+
             // get the size of the list
             // 0 if no list
             int32_t getListSize() const;
@@ -176,10 +302,32 @@ namespace NBT {
             // may contain '\n' if list or compound
             std::string getListItemAsString(int32_t i) const;
 
-            // gets the ith item of a list
-            // 0 if out of bounds
+            // gets the ith item of a list or compound
+            // the item belongs to this tag, do not delete it
+            // NULL if out of bounds or no list or compound
+            // (array values have no tags, use getListItemAsInt())
             Tag * getListItemAsTag(int32_t i) const;
 
+            // gets the contiguous values of a byte, int, or long array
+            // NULL if no such type, or for int and long arrays loaded with loadView
+            // (their values are still big-endian, use getListItemAsInt())
+            // valid until the tag is deleted, use getListSize() for the length
+            const int8_t  * getByteArrayData() const;
+            const int32_t * getIntArrayData() const;
+            const int64_t * getLongArrayData() const;
+
+            // same as above, T is the value type: getArrayData<int32_t>()
+            // NULL if the tag is no array of T
+            template <typename T> const T * getArrayData() const;
+
+            // decodes all values of an array of T into out, in any load mode
+            // out needs getListSize() values, false if the tag is no array of T
+            template <typename T> bool copyArrayData(T * out) const;
+
+            // expands the values of bits bits packed into a long array, see BitArray.h
+            // out needs count values, false if no long array or too short
+            bool unpackLongArray(unsigned int bits, BitLayout layout, uint16_t * out, size_t count) const;
+
             //========== useful functions ==========
 
             // converts a TagType into a human-readable string
@@ -188,6 +336,16 @@ namespace NBT {
             // changes the endianness of a variable of any type
             static void swapBytes(void * data, unsigned char length);
 
+            // moves the cursor behind the payload without reading it
+            // false if the payload is invalid or exceeds the Bytestream
+            static bool skipPayload(TagType type, Bytestream * data);
+
+            // returns the payload size in bytes of numeric types, 0 for others
+            static unsigned int fixedPayloadSize(TagType type);
+
+            // returns the size in bytes of one array value, 0 if no array type
+            static unsigned int arrayValueSize(TagType type);
+
         private:
             TagType type;
             std::string name;
@@ -195,29 +353,99 @@ namespace NBT {
             bool payloadToBeDeleted;
             // If true, any pointer in the payload will be removed when destroyed.
             // If false, assume the value is copied from elsewhere and deleted there.
+            bool isView = false;
+            // If true, name, strings, and arrays point into a buffer (see loadView).
+            const char * nameView = NULL;
+            uint16_t nameViewLength = 0;
+            Bytestream * buffer = NULL;
+            // The buffer viewed by this tree, only set at the tag it was loaded into.
+            const char * lazyData = NULL;
+            uint32_t lazyLength = 0;
+            // loadLazy: the unparsed payload inside the buffer, NULL once parsed.
+            Arena * arena = NULL;
+            bool inArena = false;
+            // loadArena: the arena holding the payload tree, owned by the loaded tag,
+            // the other tags of the tree are allocated in it (inArena) and never deleted.
+            int32_t * nameIndex = NULL;
+            uint32_t nameIndexMask = 0;
+            uint32_t nameIndexSize = 0;
+            // Compounds: open addressing table of child positions (-1 if empty),
+            // nameIndexMask+1 entries, built for nameIndexSize children (see findChild()).
+            Tag * parent = NULL;
+            // The compound or list this tag was loaded into, reset its index when reloading.
 
             //========== private functions ==========
 
             // returns true if type is
             // isIntType:   tagTypeByte, tagTypeShort, tagTypeInt, or tagTypeLong
             // isFloatType: tagTypeFloat or tagTypeDouble
-            // isListType:  tagTypeByteArray, tagTypeIntArray, or tagTypeList
+            // isListType:  tagTypeByteArray, tagTypeIntArray, tagTypeLongArray, or tagTypeList
+            // isArrayType: tagTypeByteArray, tagTypeIntArray, or tagTypeLongArray
             static bool isIntType(TagType type);
             static bool isFloatType(TagType type);
             static bool isListType(TagType type);
+            static bool isArrayType(TagType type);
+
+            // reads type, name, and payload from the Bytestream
+            // if defer is set, the payload is only located (see loadLazy)
+            Tag * readTag(Bytestream * data, int flags, bool defer = false);
 
             // reads the payload from the Bytestream and returns it
-            Payload * readPayload(TagType type, Bytestream * data);
+            Payload * readPayload(TagType type, Bytestream * data, int flags);
+
+            // parses the payload located by a lazy load, if not done yet
+            void parseLazy();
+
+            // true if the name equals str, without copying a viewed name
+            bool nameEquals(const std::string & str) const;
+            bool nameEquals(const char * str, size_t length) const;
+
+            // gets the compound child with the name, else the item at index (if not -1)
+            // NULL if there is none
+            Tag * getChild(const char * childName, size_t length, uint32_t hash, int32_t index);
 
-            // creates a tag from the supplied payload
-            // returns NULL if invalid type or payload
-            static Tag * createTagFromPayload(std::string name, TagType type, Payload * payload);
+            // index of the compound child with the name, -1 if none
+            // hash is hashName() of the name
+            // compounds of nameIndexMinSize or more children are indexed when loaded
+            int32_t findChild(const char * childName, size_t length, uint32_t hash);
+
+            // fills nameIndex with the positions of the compound children
+            void buildNameIndex(const TagVector & children);
+
+            // FNV-1a hash of a name
+            static uint32_t hashName(const char * str, size_t length);
+
+            // parses a list index of decimal digits, false if it is none
+            static bool parseIndex(const char * str, size_t length, int32_t * index);
+
+            // returns the size of type, name, and payload when written
+            unsigned long int getWrittenSize() const;
+
+            // returns the size of the payload when written
+            static unsigned long int getPayloadSize(TagType type, const Payload * payload, bool view);
+
+            // writes type, name, and payload to out, which has getWrittenSize() bytes
+            // returns the position behind the written tag
+            char * writeTag(char * out) const;
+
+            // writes the payload to out, returns the position behind it
+            static char * writePayload(TagType type, const Payload * payload, bool view, char * out);
+
+            // creates an empty child tag in the arena of this tag, or on the heap
+            Tag * createChild();
 
             // free compound, list, or array before deleting payload pointer
             void safeRemovePayload();
             void safeRemovePayload(Payload * payloadi, TagType type);
     };
 
+    template <> const int8_t  * Tag::getArrayData<int8_t>() const;
+    template <> const int32_t * Tag::getArrayData<int32_t>() const;
+    template <> bool Tag::copyArrayData<int8_t>(int8_t * out) const;
+    template <> bool Tag::copyArrayData<int32_t>(int32_t * out) const;
+    template <> const int64_t * Tag::getArrayData<int64_t>() const;
+    template <> bool Tag::copyArrayData<int64_t>(int64_t * out) const;
+
 }
 
 #endif
@@ -5,9 +5,26 @@
  * Optionally prints center x, center z, width, and height of the map.
  * The current color data is from the default texture pack, slightly adjusted by me.
  * The renderer even calculates block transparency and does a bit of height mapping.
+ * Sections with block ids (Anvil) and with block state palettes (1.13 and later) are supported.
  *
- * Arguments: <worldpath> [center x=0] [center z=0] [width=256] [height=256] [zoom=1] [info text size=10]
+ * Arguments: [--cache <cachedir>] [--tiles <outdir> [--incremental]] <worldpath> [center x=0] [center z=0] [width=256] [height=256] [zoom=1] [info text size=10]
  *
+ * - --cache: Keeps the surface colors of each rendered chunk in <cachedir>, one file per region.
+ *     Later renders of any part of the world, at any zoom and also with --tiles, only parse
+ *     the chunks that were saved since, by their timestamps in the region header.
+ *     Delete the cache after changing the colors.
+ *     - Example: "cache/"
+ * - --tiles: Renders the whole world into tiles of a slippy map instead, one file per tile.
+ *     Tiles are 512x512 pixels, <outdir>/8/<x>/<y>.png shows the region x,y with one pixel per block.
+ *     Each lower zoom level down to 0 is made by shrinking the four tiles above it by half.
+ *     Missing tiles are built again, and tiles of deleted regions are removed.
+ *     The other arguments besides worldpath are ignored.
+ *     - Example: "tiles/"
+ * - --incremental: With --tiles, keeps the tiles of an earlier run and renders only what changed since.
+ *     Next to each region tile, <outdir>/8/<x>/<y>.stamps records the timestamps of its chunks from
+ *     the region header. Only chunks with other stamps are rendered again, and only the lower zoom
+ *     tiles above changed region tiles are rebuilt. Leave it out after changing the colors.
+ *     Chunks that could not be read are tried again in the next run.
  * - worldpath: The path to the Minecraft world.
  *     - Example: "saves/Legio-Umbra/"
  * - center x: The x coordinate of the block at the center of the image.
@@ -31,18 +48,45 @@
  * by Gjum <gjum42@gmail.com> <http://gjum.sytes.net/>
  */
 
-#include <omp.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <stdint.h> // BlockColor
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include <cairo/cairo.h>
+#include <zlib.h>
 #include "nbt/Tag.h"
+#include "nbt/Region.h"
+#include "nbt/BitArray.h"
 
 const unsigned char heightMappingDarknessPercent = 95;
 
 typedef int32_t BlockColor;
 
 BlockColor blockColors[4096]; // 2^(8+4), id has 8 bit, meta has 4 bit
+std::unordered_map<std::string, BlockColor> blockNameColors; // for block state palettes
+
+// compiled once, queried for every chunk and section
+const NBT::TagPath levelPath("Level");
+const NBT::TagPath sectionsPath("Sections");
+const NBT::TagPath blocksPath("Blocks");
+const NBT::TagPath dataPath("Data");
+const NBT::TagPath addPath("Add");
+const NBT::TagPath yPath("Y");
+const NBT::TagPath palettePath("Palette");         // 1.13 to 1.17
+const NBT::TagPath blockStatesPath("BlockStates");
+const NBT::TagPath sectionsNewPath("sections");    // 1.18 and later, without Level
+const NBT::TagPath paletteNewPath("block_states.palette");
+const NBT::TagPath blockStatesNewPath("block_states.data");
+const NBT::TagPath namePath("Name");
+const NBT::TagPath surfacePath("Heightmaps.WORLD_SURFACE"); // 1.13 and later
+const NBT::TagPath yPosPath("yPos"); // lowest section y, since 1.18
 
 int blockColorID(int id, int meta) {
     return id | (meta << 8);
@@ -52,6 +96,10 @@ void SetColor(unsigned char id, unsigned char meta, BlockColor value) {
     blockColors[blockColorID(id, meta)] = value;
 }
 
+void SetNameColor(const char * name, BlockColor value) {
+    blockNameColors[name] = value;
+}
+
 void buildColorTable() {
     for (unsigned int i = 0; i < 4096; i++) {
         blockColors[i] = 0;
@@ -59,17 +107,128 @@ void buildColorTable() {
     // too many colors, I put them in an extra file
     // they are included at compile time
 #include "MapColors.txt"
+#include "MapNameColors.txt"
+    // maybe only metadata is unknown? use meta=0
+    // resolved here once instead of for every block
+    for (int id = 0; id < 256; id++) {
+        for (int meta = 1; meta < 16; meta++) {
+            if (blockColors[blockColorID(id, meta)] == 0)
+                blockColors[blockColorID(id, meta)] = blockColors[blockColorID(id, 0)];
+        }
+    }
 }
 
 BlockColor blockColorOf(int id, int meta) {
     return blockColors[blockColorID(id, meta)];
 }
 
-void drawChunkOnMap(cairo_surface_t * surface, BlockColor chunkColors[], int x, int z, int zoom) {
-    cairo_surface_flush(surface);
-    BlockColor * imgdata = (BlockColor *) cairo_image_surface_get_data(surface);
-    int imgwidth  = cairo_image_surface_get_width(surface);
-    int imgheight = cairo_image_surface_get_height(surface);
+// 0 if unknown
+BlockColor blockColorOf(const std::string & name) {
+    std::unordered_map<std::string, BlockColor>::const_iterator it = blockNameColors.find(name);
+    return it != blockNameColors.end() ? it->second : 0;
+}
+
+// the blocks of one 16x16x16 section, as indices into a color table
+struct Section {
+    int y; // blocks from 16*y to 16*y+15
+    uint16_t blocks[16*16*16]; // in YZX order, like the NBT arrays
+    const BlockColor * colors; // blockColors, or palette
+    std::vector<BlockColor> palette; // the section's block states resolved to colors
+    uint64_t columns[16*16/64]; // bit per column, set if it has any colored block
+};
+
+// bits needed to store values up to n-1
+unsigned int bitsFor(size_t n) {
+    unsigned int bits = 0;
+    while (bits < 16 && ((size_t) 1 << bits) < n) bits++;
+    return bits;
+}
+
+// converts the block ids and metadata of an Anvil section
+bool decodeLegacySection(NBT::Tag * section, Section * out) {
+    NBT::Tag * blocks = section->getSubTag(blocksPath);
+    NBT::Tag * data = section->getSubTag(dataPath);
+    NBT::Tag * add = section->getSubTag(addPath);
+    const int8_t * ids = blocks != NULL ? blocks->getByteArrayData() : NULL;
+    const int8_t * metas = data != NULL ? data->getByteArrayData() : NULL;
+    const int8_t * adds = add != NULL ? add->getByteArrayData() : NULL;
+    if (ids == NULL || metas == NULL) return false; // no block data in this section
+    if (blocks->getListSize() < 4096 || data->getListSize() < 2048) return false;
+    if (adds != NULL && add->getListSize() < 2048) adds = NULL;
+    for (int b = 0; b < 16*16*16; b++) {
+        unsigned char meta = ((unsigned char) metas[b/2] >> (b%2)*4) & 0x0F;
+        out->blocks[b] = blockColorID((unsigned char) ids[b], meta);
+        // ids above 255 have no colors
+        if (adds != NULL && (((unsigned char) adds[b/2] >> (b%2)*4) & 0x0F) != 0)
+            out->blocks[b] = 0;
+    }
+    out->colors = blockColors;
+    return true;
+}
+
+// converts the packed palette indices of a 1.13 or later section
+// the palette is resolved to colors once, the blocks only get indices
+bool decodePaletteSection(NBT::Tag * palette, NBT::Tag * states, Section * out) {
+    int32_t paletteSize = palette->getListSize();
+    if (paletteSize <= 0) return false;
+    unsigned int bits = bitsFor(paletteSize);
+    if (bits < 4) bits = 4;
+    if (states == NULL && paletteSize == 1) bits = 0; // whole section is the one block state
+    if (bits > NBT::maxPackedBits) return false;
+    // every index bits can hold gets a color, so corrupt indices stay inside
+    out->palette.assign((size_t) 1 << bits, 0);
+    for (int32_t i = 0; i < paletteSize; i++) {
+        NBT::Tag * name = palette->getListItemAsTag(i)->getSubTag(namePath);
+        if (name != NULL) out->palette[i] = blockColorOf(name->asString());
+    }
+    out->colors = out->palette.data();
+    if (bits == 0) {
+        for (int b = 0; b < 16*16*16; b++) out->blocks[b] = 0;
+        return true;
+    }
+    if (states == NULL) return false;
+    // the length tells the layouts apart, they only match for 4, 8, and 16 bits
+    NBT::BitLayout layout = NBT::bitsPadded;
+    if ((size_t) states->getListSize() == NBT::packedLength(16*16*16, bits, NBT::bitsSpanning))
+        layout = NBT::bitsSpanning;
+    return states->unpackLongArray(bits, layout, out->blocks, 16*16*16);
+}
+
+// decodes any kind of section
+// false if it has no blocks
+bool decodeSection(NBT::Tag * section, Section * out) {
+    NBT::Tag * y = section->getSubTag(yPath);
+    if (y == NULL) return false;
+    out->y = y->asInt();
+    NBT::Tag * palette = section->getSubTag(palettePath);
+    bool decoded;
+    if (palette != NULL) decoded = decodePaletteSection(palette, section->getSubTag(blockStatesPath), out);
+    else if ((palette = section->getSubTag(paletteNewPath)) != NULL)
+        decoded = decodePaletteSection(palette, section->getSubTag(blockStatesNewPath), out);
+    else decoded = decodeLegacySection(section, out);
+    if (!decoded) return false;
+    // lets the renderer skip columns without blocks in this section
+    for (int i = 0; i < 16*16/64; i++) out->columns[i] = 0;
+    for (int b = 0; b < 16*16*16; b++) {
+        if (out->colors[out->blocks[b]] != 0)
+            out->columns[b%(16*16)/64] |= (uint64_t) 1 << (b%64);
+    }
+    return true;
+}
+
+// an ARGB32 image in memory, handed to cairo when it is complete
+struct Image {
+    BlockColor * data;
+    int width;
+    int height;
+    int stride; // pixels per row
+};
+
+// chunks never overlap, so threads can draw different chunks without locking
+void drawChunkOnMap(Image * image, const BlockColor chunkColors[], int x, int z, int zoom) {
+    BlockColor * imgdata = image->data;
+    int imgwidth  = image->width;
+    int imgheight = image->height;
     for (int i = 0; i < 16*16; i++) { // all blocks in chunk
         if (chunkColors[i] == 0) {
             //printf("Rendering: Tried to render air block, chunk %i,%i block %i, color %x\n", x, z, i, chunkColors[i]);
@@ -80,85 +239,592 @@ void drawChunkOnMap(cairo_surface_t * surface, BlockColor chunkColors[], int x,
         if (imgx < 0 || imgy < 0 || imgx >= imgwidth || imgy >= imgheight) {
             continue; // outside the image, happens because we render chunks completely even if only partly on the image
         }
-        int imgIndex = imgx + imgy*imgwidth;
+        int imgIndex = imgx + imgy*image->stride;
         for (int j = 0; j < zoom*zoom; j++) // rectangle for one block
-            imgdata[imgIndex + j%zoom+(j/zoom)*imgwidth] = chunkColors[i];
+            imgdata[imgIndex + j%zoom+(j/zoom)*image->stride] = chunkColors[i];
+    }
+}
+
+// adds the color of the block at height y below the color found so far
+BlockColor blendBelow(BlockColor oldColor, BlockColor newColor, int y) {
+    if (oldColor == 0) {
+        // first time coloring
+        // heightmap visualization
+        if (y%2 == 0) {
+            // darker color
+            unsigned char * colorArray = (unsigned char *) &newColor;
+            colorArray[0] = (int)colorArray[0] * heightMappingDarknessPercent / 100;
+            colorArray[1] = (int)colorArray[1] * heightMappingDarknessPercent / 100;
+            colorArray[2] = (int)colorArray[2] * heightMappingDarknessPercent / 100;
+        }
+    }
+    else {
+        // we do not have full opacity yet
+        // combine block color and current color (transparent)
+        unsigned char * oldArray = (unsigned char *) &oldColor;
+        unsigned char * newArray = (unsigned char *) &newColor;
+        int c = (int(newArray[3]) * int(0xff - oldArray[3]) + oldArray[3] * 0xff) / 0xff;
+        if (c > 0xff) c = 0xff;
+        newArray[3] = c;
+        for (int i = 0; i < 3; i++) {
+            int c = (int(newArray[i]) * int(0xff - oldArray[3]) + oldArray[i] * oldArray[3]) / 0xff;
+            if (c > 0xff) c = 0xff;
+            newArray[i] = c;
+        }
     }
-    cairo_surface_mark_dirty_rectangle(surface, x, z, 16*zoom, 16*zoom);
+    return newColor;
+}
+
+// the sections of a chunk by their y, each one is decoded on first use
+class SectionLookup {
+    public:
+        SectionLookup(NBT::Tag * sectionList) {
+            bottom = 0;
+            if (sectionList == NULL) return;
+            int top = 0;
+            for (int32_t i = 0; i < sectionList->getListSize(); i++) {
+                NBT::Tag * section = sectionList->getListItemAsTag(i);
+                NBT::Tag * y = section != NULL ? section->getSubTag(yPath) : NULL;
+                if (y == NULL) continue;
+                if (tags.empty() || y->asInt() < bottom) bottom = y->asInt();
+                if (tags.empty() || y->asInt() > top) top = y->asInt();
+                tags.push_back(section);
+            }
+            if (tags.empty()) return;
+            if (top - bottom >= 256) { // corrupt, more than any world has
+                tags.clear();
+                return;
+            }
+            std::vector<NBT::Tag *> list(tags);
+            tags.assign(top - bottom + 1, NULL);
+            for (size_t i = 0; i < list.size(); i++)
+                tags[list[i]->getSubTag(yPath)->asInt() - bottom] = list[i];
+            state.assign(tags.size(), 0);
+            sections.reset(new Section[tags.size()]);
+        }
+
+        // NULL if there are no blocks at section y
+        Section * get(int y) {
+            if (y < bottom || y >= bottom + (int) tags.size()) return NULL;
+            int i = y - bottom;
+            if (state[i] == 0)
+                state[i] = tags[i] != NULL && decodeSection(tags[i], &sections[i]) ? 1 : -1;
+            return state[i] > 0 ? &sections[i] : NULL;
+        }
+
+        // the highest block y of all sections
+        int getTopBlock() const { return (bottom + (int) tags.size()) * 16 - 1; }
+        // the lowest block y of all sections
+        int getBottomBlock() const { return bottom * 16; }
+
+    private:
+        int bottom; // lowest section y
+        std::vector<NBT::Tag *> tags; // by y - bottom, NULL if missing
+        std::vector<signed char> state; // 0: not decoded yet, 1: has blocks, -1: has none
+        std::unique_ptr<Section[]> sections;
+};
+
+// reads the y of the highest non-air block of each column into tops
+// false if the chunk has no WORLD_SURFACE heightmap (before 1.13)
+bool getSurfaceTops(NBT::Tag * level, int tops[]) {
+    NBT::Tag * heightmap = level->getSubTag(surfacePath);
+    if (heightmap == NULL) return false;
+    // 9 bits per column are enough for worlds up to 511 blocks high
+    uint16_t heights[16*16];
+    NBT::BitLayout layout = NBT::bitsPadded;
+    if ((size_t) heightmap->getListSize() == NBT::packedLength(16*16, 9, NBT::bitsSpanning))
+        layout = NBT::bitsSpanning;
+    if (!heightmap->unpackLongArray(9, layout, heights, 16*16)) return false;
+    // heights count from the bottom of the world, which is below 0 since 1.18
+    // without yPos the tops can only be too high, which costs time but is still correct
+    NBT::Tag * yPos = level->getSubTag(yPosPath);
+    int bottom = yPos != NULL ? yPos->asInt() * 16 : 0;
+    for (int i = 0; i < 16*16; i++)
+        tops[i] = bottom + heights[i] - 1; // 0 is an empty column
+    return true;
 }
 
 void getColorsFromChunk(NBT::Tag * level, BlockColor chunkColors[]) {
-    for (int i = 0; i < 16*16; i++) chunkColors[i] = 0; // clear all colors
-    unsigned int colorsFound = 0; // for quick stopping
-    // search all sections, begin at the top (assuming they are sorted)
-    // loop breaks when all 16*16 visible blocks have been found
-    for (int sectionID = 15; sectionID >= 0; sectionID--) {
-        //printf("Rendering: section %i\n", sectionID);
-        NBT::Tag * section = level->getSubTag("Sections")->getListItemAsTag(sectionID);
-        if (section == NULL) continue; // skip empty sections
-        NBT::Tag * ids = section->getSubTag("Blocks");
-        NBT::Tag * metas = section->getSubTag("Data");
-        // search all blocks in section, begin at the top
-        for (int b = 16*16*16-1; b >= 0; b--) {
-            BlockColor oldColor = chunkColors[b%(16*16)];
-            if (oldColor >= 0xff000000) continue; // skip, we are already opaque
-            unsigned char id = ids->getListItemAsInt(b);
-            if (id == 0) continue; // quick jump for air
-            unsigned char meta = (metas->getListItemAsInt(b/2) >> (b%2)*4) & 0x0F;
-            BlockColor newColor = blockColorOf(id, meta);
-            // error handling
-            if (newColor == 0) {
-                // could not find the color, although there is a block here
-                // maybe only metadata is unknown? try meta=0
-                newColor = blockColorOf(id, 0);
-                if (newColor == 0) {
-                    // unknown block id and meta? get block below
-                    //printf("colorAt: Didn't get color: block %3i:%i\n", id, meta);
-                    continue;
-                }
+    NBT::Tag * sectionList = level->getSubTag(sectionsPath);
+    if (sectionList == NULL) sectionList = level->getSubTag(sectionsNewPath);
+    SectionLookup sections(sectionList);
+    // start each column at its highest block if the heightmap knows it,
+    // the old HeightMap is no help as it skips blocks like glass and torches
+    int tops[16*16];
+    bool haveTops = getSurfaceTops(level, tops);
+    // walk down each column until the color is opaque
+    for (int column = 0; column < 16*16; column++) {
+        BlockColor color = 0;
+        int y = sections.getTopBlock();
+        if (haveTops && tops[column] < y) y = tops[column];
+        while (y >= sections.getBottomBlock()) {
+            Section * section = sections.get(y >> 4);
+            if (section == NULL || !(section->columns[column/64] >> (column%64) & 1)) {
+                y = (y >> 4) * 16 - 1; // nothing in this column, go to the section below
+                continue;
             }
-            if (oldColor == 0) {
-                // first time coloring
-                // heightmap visualization
-                if ((b/256)%2 == 0) {
-                    // darker color
-                    unsigned char * colorArray = (unsigned char *) &newColor;
-                    colorArray[0] = (int)colorArray[0] * heightMappingDarknessPercent / 100;
-                    colorArray[1] = (int)colorArray[1] * heightMappingDarknessPercent / 100;
-                    colorArray[2] = (int)colorArray[2] * heightMappingDarknessPercent / 100;
-                }
+            BlockColor newColor = section->colors[section->blocks[(y & 15)*16*16 + column]];
+            // air, or unknown block? get block below
+            if (newColor != 0) {
+                color = blendBelow(color, newColor, y);
+                if (color >= 0xff000000) break; // opaque, done
+            }
+            y--;
+        }
+        chunkColors[column] = color;
+    }
+}
+
+// where the chunk is stored, as in the region header, 0 if not present
+// changes whenever the chunk is saved with another size
+uint32_t getChunkLocation(const NBT::RegionFile & region, int chunkx, int chunkz) {
+    return region.getChunkOffset(chunkx, chunkz) << 8 | region.getChunkSectors(chunkx, chunkz);
+}
+
+// the surface of a chunk, as found by getColorsFromChunk
+struct CachedChunk {
+    // the location and timestamp of the chunk it was found in, location 0 if there is none
+    uint32_t location;
+    uint32_t timestamp;
+    BlockColor colors[16*16];
+};
+
+// the surfaces of all chunks of a region, kept on disk in <cachedir>/r.<x>.<z>.colors
+// a surface is only used while the location and timestamp of its chunk are unchanged,
+// so renders of any part of the world at any zoom only parse the chunks saved since
+// the file is gzipped (most of it are empty chunks and runs of equal colors), in host byte order,
+// and has to be deleted after changing the colors
+class ColorCache {
+    public:
+        // loads the cache file of the region, the cache starts empty without one
+        ColorCache(const std::string & cacheDir, int regionx, int regionz) {
+            path = cacheDir + "/r." + std::to_string(regionx) + "." + std::to_string(regionz) + ".colors";
+            changed = false;
+            chunks.reset(new CachedChunk[1024]);
+            gzFile file = gzopen(path.c_str(), "rb");
+            if (file == NULL) {
+                clear();
+                return;
+            }
+            uint32_t header[2] = { 0, 0 };
+            const int size = 1024 * sizeof(CachedChunk);
+            if (gzread(file, header, sizeof(header)) != sizeof(header) || header[0] != magic || header[1] != version) {
+                clear(); // from another version, made again
+            }
+            else if (gzread(file, chunks.get(), size) != size) {
+                printf("ERROR: Ignoring invalid cache file '%s'\n", path.c_str());
+                clear();
+            }
+            gzclose(file);
+        }
+
+        // the surface of the chunk, NULL if the chunk changed since it was cached
+        const CachedChunk * get(const NBT::RegionFile & region, int chunkx, int chunkz) const {
+            const CachedChunk * chunk = &chunks[NBT::RegionFile::getChunkID(chunkx, chunkz)];
+            if (chunk->location == 0 || chunk->location != getChunkLocation(region, chunkx, chunkz)
+                    || chunk->timestamp != region.getChunkTimestamp(chunkx, chunkz))
+                return NULL;
+            return chunk;
+        }
+
+        // stores the surface of the chunk, only call it if the chunk could be loaded
+        void put(const NBT::RegionFile & region, int chunkx, int chunkz, const BlockColor colors[]) {
+            CachedChunk * chunk = &chunks[NBT::RegionFile::getChunkID(chunkx, chunkz)];
+            chunk->location = getChunkLocation(region, chunkx, chunkz);
+            chunk->timestamp = region.getChunkTimestamp(chunkx, chunkz);
+            memcpy(chunk->colors, colors, sizeof(chunk->colors));
+            changed = true;
+        }
+
+        // writes the cache file if anything was put
+        // the file is replaced at once, so it stays valid even if writing fails
+        bool save() {
+            if (!changed) return true;
+            std::string tempPath = path + ".tmp";
+            uint32_t header[2] = { magic, version };
+            const int size = 1024 * sizeof(CachedChunk);
+            gzFile file = gzopen(tempPath.c_str(), "wb");
+            bool success = file != NULL && gzwrite(file, header, sizeof(header)) == sizeof(header)
+                    && gzwrite(file, chunks.get(), size) == size;
+            if (file != NULL && gzclose(file) != Z_OK) success = false;
+            if (success) success = rename(tempPath.c_str(), path.c_str()) == 0;
+            if (!success) {
+                printf("ERROR: Could not write cache file '%s'\n", path.c_str());
+                remove(tempPath.c_str());
             }
-            else {
-                // we do not have full opacity yet
-                // combine block color and current color (transparent)
-                unsigned char * oldArray = (unsigned char *) &oldColor;
-                unsigned char * newArray = (unsigned char *) &newColor;
-                int c = (int(newArray[3]) * int(0xff - oldArray[3]) + oldArray[3] * 0xff) / 0xff;
-                if (c > 0xff) c = 0xff;
-                newArray[3] = c;
-                for (int i = 0; i < 3; i++) {
-                    int c = (int(newArray[i]) * int(0xff - oldArray[3]) + oldArray[i] * oldArray[3]) / 0xff;
-                    if (c > 0xff) c = 0xff;
-                    newArray[i] = c;
+            changed = !success;
+            return success;
+        }
+
+    private:
+        static const uint32_t magic = 0x4c4f4357; // "WCOL" in little endian
+        static const uint32_t version = 2;
+
+        void clear() {
+            for (int i = 0; i < 1024; i++)
+                chunks[i].location = 0;
+        }
+
+        std::string path;
+        std::unique_ptr<CachedChunk[]> chunks; // by chunk id
+        bool changed;
+};
+
+// draws the chunks of the region that are inside the image
+// the image shows the blocks from (left, top) on, each one zoom by zoom pixels large
+// if redraw is given, only the chunks whose entry (by chunk id) is set are drawn
+// with a cache, chunks are only parsed if their surface is not cached yet
+// if failed is given, the entries of the chunks that could not be loaded are set
+void renderRegion(const NBT::RegionFile & region, int regionx, int regionz, Image * image, int left, int top, int zoom,
+        const bool * redraw = NULL, ColorCache * cache = NULL, bool * failed = NULL) {
+    // the chunks of this region inside the image
+    int fromx = std::max(left >> 4, regionx*32), tox = std::min((left + image->width/zoom) >> 4, regionx*32 + 31);
+    int fromz = std::max(top >> 4,  regionz*32), toz = std::min((top + image->height/zoom) >> 4, regionz*32 + 31);
+    for (int chunkz = fromz; chunkz <= toz; chunkz++) {
+        for (int chunkx = fromx; chunkx <= tox; chunkx++) {
+            //printf("Rendering: chunk %i,%i\n", chunkx, chunkz);
+            if (redraw != NULL && !redraw[NBT::RegionFile::getChunkID(chunkx, chunkz)]) continue;
+            if (region.getChunkOffset(chunkx, chunkz) == 0) continue; // no chunk present
+            const CachedChunk * cached = cache != NULL ? cache->get(region, chunkx, chunkz) : NULL;
+            if (cached != NULL) {
+                drawChunkOnMap(image, cached->colors, (chunkx*16-left)*zoom, (chunkz*16-top)*zoom, zoom);
+                continue;
+            }
+            NBT::Tag * chunk = (new NBT::Tag)->loadFromChunk(&region, chunkx, chunkz, NBT::loadLazy | NBT::loadArena);
+            if (chunk->getType() != NBT::tagTypeCompound) { // unreadable, nothing to draw
+                if (failed != NULL) failed[NBT::RegionFile::getChunkID(chunkx, chunkz)] = true;
+                delete chunk;
+                continue;
+            }
+            NBT::Tag * level = chunk->getSubTag(levelPath);
+            if (level == NULL) level = chunk; // since 1.18, the sections are at the top
+            BlockColor chunkColors[16*16];
+            getColorsFromChunk(level, chunkColors);
+            drawChunkOnMap(image, chunkColors, (chunkx*16-left)*zoom, (chunkz*16-top)*zoom, zoom);
+            delete chunk;
+            if (cache != NULL) cache->put(region, chunkx, chunkz, chunkColors);
+        }
+    }
+}
+
+// counts finished tasks from all threads and prints the percentage when it changes
+void reportProgress(unsigned int * progress, size_t total) {
+    unsigned int done;
+#pragma omp atomic capture
+    done = ++*progress;
+    unsigned int progressOldPercent = 100*(done-1)/total;
+    unsigned int progressPercent    = 100*done/total;
+    if (progressPercent > progressOldPercent)
+        printf("Progress: %i%%\n", progressPercent);
+}
+
+//========== tiles ==========
+
+// tiles/<maxTileZoom>/<x>/<y>.png is the region (x,y), one pixel per block
+// each lower zoom level halves the resolution, at 0 a tile covers 256x256 regions
+const int maxTileZoom = 8;
+const int tileSize = 512; // pixels, one per block of a region
+
+// creates the directory and its parents, like mkdir -p
+bool makeDirs(const std::string & path) {
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos+1)) {
+        std::string dir = path.substr(0, pos);
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            printf("ERROR: Could not create directory '%s'\n", dir.c_str());
+            return false;
+        }
+        if (pos == std::string::npos) return true;
+    }
+}
+
+std::string tilePath(const std::string & outdir, int zoomLevel, int x, int y, const char * extension = ".png") {
+    return outdir + "/" + std::to_string(zoomLevel) + "/" + std::to_string(x) + "/" + std::to_string(y) + extension;
+}
+
+// writes the image as tile (x,y) of the zoom level
+bool writeTile(const std::string & outdir, int zoomLevel, int x, int y, Image * image) {
+    if (!makeDirs(outdir + "/" + std::to_string(zoomLevel) + "/" + std::to_string(x))) return false;
+    cairo_surface_t * surface = cairo_image_surface_create_for_data((unsigned char *) image->data,
+            CAIRO_FORMAT_ARGB32, image->width, image->height, image->stride * 4);
+    std::string path = tilePath(outdir, zoomLevel, x, y);
+    bool success = cairo_surface_write_to_png(surface, path.c_str()) == CAIRO_STATUS_SUCCESS;
+    if (!success) printf("ERROR: Could not write tile '%s'\n", path.c_str());
+    cairo_surface_destroy(surface);
+    return success;
+}
+
+// reads the tile at path into image, false if there is no such tile
+bool readTile(const std::string & path, Image * image) {
+    cairo_surface_t * surface = cairo_image_surface_create_from_png(path.c_str());
+    bool success = cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS
+            && cairo_image_surface_get_width(surface) == image->width
+            && cairo_image_surface_get_height(surface) == image->height;
+    if (success) {
+        cairo_surface_flush(surface);
+        const unsigned char * data = cairo_image_surface_get_data(surface);
+        int stride = cairo_image_surface_get_stride(surface);
+        for (int y = 0; y < image->height; y++)
+            memcpy(image->data + y*image->stride, data + y*stride, image->width * 4);
+    }
+    cairo_surface_destroy(surface);
+    return success;
+}
+
+// shrinks the tile at path by half into the quarter (dx,dy) of image,
+// averaging each 2x2 pixels
+// the quarter stays transparent if there is no such tile
+void downsampleTile(const std::string & path, Image * image, int dx, int dy) {
+    cairo_surface_t * surface = cairo_image_surface_create_from_png(path.c_str());
+    if (cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS
+            && cairo_image_surface_get_width(surface) == tileSize
+            && cairo_image_surface_get_height(surface) == tileSize) {
+        cairo_surface_flush(surface);
+        const unsigned char * data = cairo_image_surface_get_data(surface);
+        int stride = cairo_image_surface_get_stride(surface);
+        for (int y = 0; y < tileSize/2; y++) {
+            const unsigned char * row = data + 2*y*stride;
+            unsigned char * out = (unsigned char *) (image->data + (dy*tileSize/2 + y)*image->stride + dx*tileSize/2);
+            for (int x = 0; x < tileSize/2; x++) {
+                for (int c = 0; c < 4; c++) { // each byte of the color
+                    int sum = row[8*x + c] + row[8*x + 4 + c] + row[stride + 8*x + c] + row[stride + 8*x + 4 + c];
+                    out[4*x + c] = (sum + 2) / 4;
                 }
             }
-            // are we done already?
-            if (newColor >= 0xff000000) {
-                colorsFound++;
+        }
+    }
+    cairo_surface_destroy(surface);
+}
+
+// finds the regions of the world from the names of their files
+std::vector<std::pair<int, int> > listRegions(const char * worldpath) {
+    std::vector<std::pair<int, int> > regions;
+    std::string dirpath = std::string(worldpath) + "/region";
+    DIR * dir = opendir(dirpath.c_str());
+    if (dir == NULL) {
+        printf("ERROR: Could not open '%s'\n", dirpath.c_str());
+        return regions;
+    }
+    while (struct dirent * entry = readdir(dir)) {
+        int x, z;
+        char end;
+        if (sscanf(entry->d_name, "r.%d.%d.mc%c", &x, &z, &end) == 3 && end == 'a')
+            regions.push_back(std::make_pair(x, z));
+    }
+    closedir(dir);
+    std::sort(regions.begin(), regions.end());
+    return regions;
+}
+
+// the location and timestamp of each chunk of a region, as in its header
+// written next to each region tile as <y>.stamps, in host byte order,
+// so the next incremental run knows which chunks changed since
+// chunks that could not be read have 0 for both, so they are tried again
+struct TileStamps {
+    uint32_t locations[1024];
+    uint32_t timestamps[1024];
+};
+
+// copies the stamps of all chunks from the header of the region
+void getTileStamps(const NBT::RegionFile & region, int regionx, int regionz, TileStamps * stamps) {
+    for (int chunkz = regionz*32; chunkz < regionz*32 + 32; chunkz++) {
+        for (int chunkx = regionx*32; chunkx < regionx*32 + 32; chunkx++) {
+            unsigned int id = NBT::RegionFile::getChunkID(chunkx, chunkz);
+            stamps->locations[id] = getChunkLocation(region, chunkx, chunkz);
+            stamps->timestamps[id] = region.getChunkTimestamp(chunkx, chunkz);
+        }
+    }
+}
+
+// false if there is no stamps file, e.g. the tile was never rendered
+bool readTileStamps(const std::string & path, TileStamps * stamps) {
+    FILE * file = fopen(path.c_str(), "rb");
+    if (file == NULL) return false;
+    bool success = fread(stamps, sizeof(TileStamps), 1, file) == 1;
+    fclose(file);
+    return success;
+}
+
+bool writeTileStamps(const std::string & path, const TileStamps & stamps) {
+    FILE * file = fopen(path.c_str(), "wb");
+    bool success = file != NULL && fwrite(&stamps, sizeof(TileStamps), 1, file) == 1;
+    if (file != NULL && fclose(file) != 0) success = false;
+    if (!success) printf("ERROR: Could not write '%s'\n", path.c_str());
+    return success;
+}
+
+// renders the region into its tile at the highest zoom level and records the stamps of its chunks
+// if incremental, the old tile is kept and only the chunks whose stamps changed are drawn again
+// returns false if the tile was not written, because nothing changed or the region is unreadable
+bool renderRegionTile(const char * worldpath, const std::string & outdir, int x, int y, bool incremental, const std::string & cacheDir) {
+    NBT::RegionFile region;
+    if (!region.open(NBT::RegionFile::getPath(worldpath, x*32, y*32), true)) return false;
+    TileStamps stamps, previous;
+    getTileStamps(region, x, y, &stamps);
+    std::string stampsPath = tilePath(outdir, maxTileZoom, x, y, ".stamps");
+
+    Image image;
+    image.width = image.height = image.stride = tileSize;
+    image.data = (BlockColor *) calloc(tileSize * tileSize, 4);
+    if (image.data == NULL) return false;
+    std::unique_ptr<ColorCache> cache;
+    if (!cacheDir.empty()) cache.reset(new ColorCache(cacheDir, x, y));
+    bool failed[1024] = { false };
+    if (incremental && readTileStamps(stampsPath, &previous)
+            && readTile(tilePath(outdir, maxTileZoom, x, y), &image)) {
+        bool redraw[1024];
+        bool changed = false;
+        for (int id = 0; id < 1024; id++) {
+            redraw[id] = stamps.locations[id] != previous.locations[id] || stamps.timestamps[id] != previous.timestamps[id];
+            if (!redraw[id]) continue;
+            changed = true;
+            // the chunk may have been removed, and transparent pixels are not drawn, so clear it first
+            for (int row = 0; row < 16; row++)
+                memset(image.data + ((id/32)*16 + row)*image.stride + (id%32)*16, 0, 16*4);
+        }
+        if (!changed) {
+            free(image.data);
+            return false;
+        }
+        renderRegion(region, x, y, &image, x*tileSize, y*tileSize, 1, redraw, cache.get(), failed);
+    }
+    else renderRegion(region, x, y, &image, x*tileSize, y*tileSize, 1, NULL, cache.get(), failed);
+    if (cache) cache->save();
+    // unreadable chunks get no stamps, so the next run tries them again
+    for (int id = 0; id < 1024; id++) {
+        if (!failed[id]) continue;
+        stamps.locations[id] = 0;
+        stamps.timestamps[id] = 0;
+    }
+
+    // a tile without its stamps is rendered again in full next time, even if writing fails halfway
+    remove(stampsPath.c_str());
+    bool success = writeTile(outdir, maxTileZoom, x, y, &image) && writeTileStamps(stampsPath, stamps);
+    free(image.data);
+    return success;
+}
+
+// the tiles of the next lower zoom level that contain the tiles, sorted
+std::vector<std::pair<int, int> > parentTiles(const std::vector<std::pair<int, int> > & tiles) {
+    std::vector<std::pair<int, int> > parents;
+    for (size_t i = 0; i < tiles.size(); i++)
+        parents.push_back(std::make_pair(tiles[i].first >> 1, tiles[i].second >> 1));
+    std::sort(parents.begin(), parents.end());
+    parents.erase(std::unique(parents.begin(), parents.end()), parents.end());
+    return parents;
+}
+
+// true if the file exists
+bool fileExists(const std::string & path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0;
+}
+
+// finds the tiles of the zoom level that are on disk, from earlier runs
+std::vector<std::pair<int, int> > listTiles(const std::string & outdir, int zoomLevel) {
+    std::vector<std::pair<int, int> > tiles;
+    std::string levelPath = outdir + "/" + std::to_string(zoomLevel);
+    DIR * levelDir = opendir(levelPath.c_str());
+    if (levelDir == NULL) return tiles; // nothing rendered yet
+    while (struct dirent * column = readdir(levelDir)) {
+        int x;
+        char end;
+        if (sscanf(column->d_name, "%d%c", &x, &end) != 1) continue;
+        DIR * columnDir = opendir((levelPath + "/" + column->d_name).c_str());
+        if (columnDir == NULL) continue;
+        while (struct dirent * entry = readdir(columnDir)) {
+            int y;
+            if (sscanf(entry->d_name, "%d.pn%c", &y, &end) == 2 && end == 'g')
+                tiles.push_back(std::make_pair(x, y));
+        }
+        closedir(columnDir);
+    }
+    closedir(levelDir);
+    std::sort(tiles.begin(), tiles.end());
+    return tiles;
+}
+
+// renders every region of the world into its own tile, then builds the
+// lower zoom levels from the finished tiles
+// only a few tiles are in memory at any time, no matter how large the world is
+// if incremental, only the changed chunks and the tiles showing them are rendered again
+// tiles missing on disk are always rebuilt, tiles of deleted regions are removed
+void renderTiles(const char * worldpath, const std::string & outdir, bool incremental, const std::string & cacheDir) {
+    std::vector<std::pair<int, int> > regions = listRegions(worldpath);
+    printf("Rendering %lu region tiles ...\n", (unsigned long int) regions.size());
+    std::vector<char> written(regions.size(), 0);
+    unsigned int progress = 0;
+#pragma omp parallel for schedule(dynamic) shared(regions, written, progress)
+    for (size_t task = 0; task < regions.size(); task++) {
+        written[task] = renderRegionTile(worldpath, outdir, regions[task].first, regions[task].second, incremental, cacheDir);
+        reportProgress(&progress, regions.size());
+    }
+
+    // the tiles whose parents have to be built again: the written ones and the removed ones
+    std::vector<std::pair<int, int> > changed;
+    for (size_t i = 0; i < regions.size(); i++)
+        if (written[i]) changed.push_back(regions[i]);
+    if (incremental)
+        printf("%lu of %lu region tiles changed\n", (unsigned long int) changed.size(), (unsigned long int) regions.size());
+    std::vector<std::pair<int, int> > oldTiles = listTiles(outdir, maxTileZoom);
+    for (size_t i = 0; i < oldTiles.size(); i++) {
+        if (std::binary_search(regions.begin(), regions.end(), oldTiles[i])) continue;
+        printf("Removing tile of deleted region %i,%i\n", oldTiles[i].first, oldTiles[i].second);
+        remove(tilePath(outdir, maxTileZoom, oldTiles[i].first, oldTiles[i].second).c_str());
+        remove(tilePath(outdir, maxTileZoom, oldTiles[i].first, oldTiles[i].second, ".stamps").c_str());
+        changed.push_back(oldTiles[i]);
+    }
+
+    std::vector<std::pair<int, int> > tiles(regions); // all tiles of the level
+    for (int zoomLevel = maxTileZoom-1; zoomLevel >= 0; zoomLevel--) {
+        tiles = parentTiles(tiles);
+        // the parents of changed tiles, and the tiles missing on disk
+        std::vector<std::pair<int, int> > rebuild = parentTiles(changed);
+        size_t parents = rebuild.size();
+        for (size_t i = 0; i < tiles.size(); i++) {
+            if (std::binary_search(rebuild.begin(), rebuild.begin() + parents, tiles[i])) continue;
+            if (!fileExists(tilePath(outdir, zoomLevel, tiles[i].first, tiles[i].second))) rebuild.push_back(tiles[i]);
+        }
+        std::sort(rebuild.begin(), rebuild.end());
+        printf("Zoom level %i: %lu tiles ...\n", zoomLevel, (unsigned long int) rebuild.size());
+#pragma omp parallel for schedule(dynamic) shared(tiles, rebuild)
+        for (size_t task = 0; task < rebuild.size(); task++) {
+            int x = rebuild[task].first, y = rebuild[task].second;
+            if (!std::binary_search(tiles.begin(), tiles.end(), rebuild[task])) {
+                // all regions of the tile were deleted
+                remove(tilePath(outdir, zoomLevel, x, y).c_str());
+                continue;
             }
-            // save color and go to next block
-            chunkColors[b%(16*16)] = newColor;
-            if (colorsFound >= 16*16) break;
+            Image image;
+            image.width = image.height = image.stride = tileSize;
+            image.data = (BlockColor *) calloc(tileSize * tileSize, 4);
+            if (image.data == NULL) continue;
+            for (int i = 0; i < 4; i++)
+                downsampleTile(tilePath(outdir, zoomLevel+1, 2*x + i%2, 2*y + i/2), &image, i%2, i/2);
+            writeTile(outdir, zoomLevel, x, y, &image);
+            free(image.data);
         }
-        delete section; // because we allocate memory when extracting list items as tags
-        if (colorsFound >= 16*16) break;
+        changed.swap(rebuild);
     }
 }
 
 int main(int argc, char* argv[]) {
-    if (argc <= 1) {
-        printf("Usage: %s <worldpath> [center x=0] [center z=0] [width=256] [height=256] [zoom=1] [info text size=10]\n", argv[0]);
-        return 0;
+    // options first, the remaining arguments are positional
+    std::string tilesDir;
+    bool incremental = false;
+    std::string cacheDir;
+    std::vector<char *> args;
+    for (int i = 0; i < argc; i++) {
+        if (std::string(argv[i]) == "--tiles" && i+1 < argc) tilesDir = argv[++i];
+        else if (std::string(argv[i]) == "--incremental") incremental = true;
+        else if (std::string(argv[i]) == "--cache" && i+1 < argc) cacheDir = argv[++i];
+        else args.push_back(argv[i]);
+    }
+    argc = args.size();
+    argv = args.data();
+    if (incremental && tilesDir.empty()) printf("ERROR: --incremental needs --tiles\n");
+    if (argc <= 1 || (incremental && tilesDir.empty())) {
+        printf("Usage: %s [--cache <cachedir>] [--tiles <outdir> [--incremental]] <worldpath> [center x=0] [center z=0] [width=256] [height=256] [zoom=1] [info text size=10]\n", argv[0]);
+        return argc <= 1 ? 0 : 1;
     }
     char * worldpath = argv[1];
     int centerx = 0;
@@ -178,43 +844,55 @@ int main(int argc, char* argv[]) {
     printf("Building color table ...\n");
     buildColorTable();
 
+    if (!cacheDir.empty() && !makeDirs(cacheDir)) return 1;
+
+    if (!tilesDir.empty()) {
+        renderTiles(worldpath, tilesDir, incremental, cacheDir);
+        printf("Done.\n");
+        return 0;
+    }
+
     // render map
     printf("Rendering map ...\n");
-    cairo_surface_t * surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width*zoom, height*zoom);
-    cairo_t * cr = cairo_create(surface);
+    Image image;
+    image.width  = width*zoom;
+    image.height = height*zoom;
+    image.stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, image.width) / 4;
+    image.data = (BlockColor *) calloc((size_t) image.stride * image.height, 4); // transparent
+    if (image.data == NULL) {
+        printf("ERROR: Could not allocate %ix%i pixels\n", image.width, image.height);
+        return 1;
+    }
     int left = centerx-width/2;
     int top  = centerz-height/2;
 
+    // one task per region, so each region is opened and mapped only once
+    // regions differ a lot in cost (missing, empty, dense), so they are handed out dynamically
+    int firstChunkx = left >> 4, lastChunkx = (left+width) >> 4;
+    int firstChunkz = top >> 4,  lastChunkz = (top+height) >> 4;
+    std::vector<std::pair<int, int> > regionTasks;
+    for (int regionz = firstChunkz >> 5; regionz <= lastChunkz >> 5; regionz++)
+        for (int regionx = firstChunkx >> 5; regionx <= lastChunkx >> 5; regionx++)
+            regionTasks.push_back(std::make_pair(regionx, regionz));
+
     unsigned int progress = 0;
-    omp_lock_t lck;
-    omp_init_lock(&lck);
-#pragma omp parallel for shared(cr, progress)
-    for (int chunkz = top >> 4; chunkz <= (top+height) >> 4; chunkz++) {
-        for (int chunkx = left >> 4; chunkx <= (left+width) >> 4; chunkx++) {
-            //printf("Rendering: chunk %i,%i\n", chunkx, chunkz);
-            NBT::Tag * chunk = (new NBT::Tag)->loadFromChunk(worldpath, chunkx, chunkz);
-            if (chunk == NULL) continue; // could not reserve memory or no chunk present
-            NBT::Tag * level = chunk->getSubTag("Level");
-            if (level == NULL) { // no chunk
-                delete chunk;
-                continue;
-            }
-            BlockColor chunkColors[16*16];
-            getColorsFromChunk(level, chunkColors);
-            omp_set_lock(&lck);
-            drawChunkOnMap(surface, chunkColors, (chunkx*16-left)*zoom, (chunkz*16-top)*zoom, zoom);
-            omp_unset_lock(&lck);
-            delete chunk;
+#pragma omp parallel for schedule(dynamic) shared(image, progress, regionTasks)
+    for (size_t task = 0; task < regionTasks.size(); task++) {
+        int regionx = regionTasks[task].first, regionz = regionTasks[task].second;
+        NBT::RegionFile region;
+        if (region.open(NBT::RegionFile::getPath(worldpath, regionx*32, regionz*32), true)) {
+            std::unique_ptr<ColorCache> cache;
+            if (!cacheDir.empty()) cache.reset(new ColorCache(cacheDir, regionx, regionz));
+            renderRegion(region, regionx, regionz, &image, left, top, zoom, NULL, cache.get());
+            if (cache) cache->save();
         }
-        omp_set_lock(&lck);
-        unsigned int progressOldPercent = 100*progress/(height/16 + 1);
-        progress++;
-        unsigned int progressPercent    = 100*progress/(height/16 + 1);
-        if (progressPercent > progressOldPercent)
-            printf("Progress: %i%%\n", progressPercent);
-        omp_unset_lock(&lck);
+        reportProgress(&progress, regionTasks.size());
     }
-    omp_destroy_lock(&lck);
+
+    // all pixels are drawn, cairo only writes text and the png
+    cairo_surface_t * surface = cairo_image_surface_create_for_data((unsigned char *) image.data,
+            CAIRO_FORMAT_ARGB32, image.width, image.height, image.stride * 4);
+    cairo_t * cr = cairo_create(surface);
 
     // print map info
     if (infoSize) {
@@ -242,6 +920,7 @@ int main(int argc, char* argv[]) {
     std::string worldname = "worldmap.png";
     cairo_surface_write_to_png(surface, worldname.c_str());
     cairo_surface_destroy(surface);
+    free(image.data);
 
     printf("Done.\n");
 